@@ -4,53 +4,226 @@
 #include "pico.h"
 #include <cstdio>
 #include "hardware/irq.h"
+#include "hardware/timer.h"
+#include "pico/sync.h"
 #include "consts.h"
 #include "FreeRTOS.h"
 #include "task.h"
 #include "fifo.h"
 #include "gs_usb_task.h"
 #include "rev.h"
+#include "FreeRTOS-Plus-CLI/FreeRTOS_CLI.h"
 
 static struct can2040 cbus;
 
+/* Software transmit queue in front of can2040's 4 entry one. It's a binary heap ordered the same way the bus
+ * arbitrates (lowest id first, then oldest first), so e.g. duty cycle setpoints never sit behind a pile of
+ * lower priority traffic the host queued up. Tasks push into it from can_send_msg, and the can2040 callback tops
+ * can2040 back up every time a frame finishes, so the bus never idles while we have frames to send.
+ * can2040 sends its own queue in fifo order, so we only ever keep CAN_TX_HW_DEPTH frames in there. Filling all 4
+ * slots would let a burst of bulk frames that got there first hold up a setpoint queued just after them.
+ * Everything in here is shared between tasks on both cores and the PIO irq. It's guarded by its own pico
+ * critical section (a hardware spin lock + irqs off on the calling core), not the kernel's locks, so sending a frame
+ * never stalls the scheduler on the other core. The lock is only ever held for a heap push or pop, or at most
+ * CAN_TX_LOCK_BATCH pushes in a row, so the can2040 irq never waits behind it for long. can2040_transmit (crc and
+ * bit stuffing the frame) happens outside it, see can_tx_feed.
+ */
 #define CAN_TX_QUEUE_LENGTH 64
+#define CAN_TX_PRIORITY_CLASSES 8
+#define CAN_TX_HW_DEPTH 2 // one on the wire and one ready to go the moment it finishes
+#define CAN_TX_LOCK_BATCH 8 // most frames can_send_msgs pushes per lock hold
+
+struct can_tx_entry {
+  uint32_t key; // arbitration order, lower wins
+  uint32_t seq;
+  uint32_t tag; // can_msg.tag, handed back with the tx done frame
+  struct can2040_msg msg;
+};
+
+static struct can_tx_entry can_tx_heap[CAN_TX_QUEUE_LENGTH];
+static uint32_t can_tx_count = 0;
+static uint32_t can_tx_seq = 0;
+static uint32_t can_tx_hw_count = 0; // frames handed to can2040 that haven't finished yet
+// their tags, oldest first. can2040 sends (and so completes) its queue in order, so the next tx done is always head's
+static uint32_t can_tx_hw_tags[CAN_TX_HW_DEPTH];
+static uint32_t can_tx_hw_head = 0;
+static bool can_tx_feeding = false; // someone is in can_tx_feed handing frames to can2040
+static uint32_t can_tx_drops[CAN_TX_PRIORITY_CLASSES];
+static critical_section_t can_tx_lock;
+
+// 11 bit base id, then IDE (standard frames win against extended ones with the same base), then the 18 bit extension
+static uint32_t can_arbitration_key(uint32_t id) {
+  if(id & CAN2040_ID_EFF) {
+    return (((id >> 18) & 0x7FF) << 19) | (1 << 18) | (id & 0x3FFFF);
+  }
+  return (id & 0x7FF) << 19;
+}
+
+// Class 0 is the highest priority. Every FRC frame starts with the same device type and manufacturer bits, so those
+// get bucketed on the top 3 bits of their 10 bit api instead (0 being setpoints and control, 6 parameter access).
+// Standard frames just use the top 3 bits of their id.
+static uint32_t can_tx_priority_class(uint32_t id) {
+  if(id & CAN2040_ID_EFF) return (id >> 13) & 0x7;
+  return (id >> 8) & 0x7;
+}
+
+static bool can_tx_before(const struct can_tx_entry *a, const struct can_tx_entry *b) {
+  if(a->key != b->key) return a->key < b->key;
+  return (int32_t) (a->seq - b->seq) < 0;
+}
+
+static bool can_tx_heap_push(const struct can2040_msg *msg, uint32_t tag) {
+  uint32_t key = can_arbitration_key(msg->id);
+  if(can_tx_count >= CAN_TX_QUEUE_LENGTH) {
+    can_tx_drops[can_tx_priority_class(msg->id)]++;
+    return false;
+  }
+
+  struct can_tx_entry entry = { .key = key, .seq = can_tx_seq++, .tag = tag, .msg = *msg };
+  uint32_t i = can_tx_count++;
+  while(i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if(!can_tx_before(&entry, &can_tx_heap[parent])) break;
+    can_tx_heap[i] = can_tx_heap[parent];
+    i = parent;
+  }
+  can_tx_heap[i] = entry;
+  return true;
+}
+
+static void can_tx_heap_pop(struct can2040_msg *out, uint32_t *tag) {
+  *out = can_tx_heap[0].msg;
+  *tag = can_tx_heap[0].tag;
+  struct can_tx_entry last = can_tx_heap[--can_tx_count];
+  uint32_t i = 0;
+  while(1) {
+    uint32_t child = 2 * i + 1;
+    if(child >= can_tx_count) break;
+    if(child + 1 < can_tx_count && can_tx_before(&can_tx_heap[child + 1], &can_tx_heap[child])) child++;
+    if(!can_tx_before(&can_tx_heap[child], &last)) break;
+    can_tx_heap[i] = can_tx_heap[child];
+    i = child;
+  }
+  can_tx_heap[i] = last;
+}
+
+/* Moves frames from our queue into can2040 while it has room. Frames are popped under the lock but handed to
+ * can2040_transmit after dropping it. can2040_transmit can't be called from two places at once, so only one caller
+ * (a task on either core, or the tx done irq) feeds at a time. Anyone who finds can_tx_feeding set just leaves it to
+ * whoever is feeding, who looks for room and frames again under the lock after every frame, so nothing gets missed.
+ * The catch is that a task preempted in the middle of its can2040_transmit holds feeding up until it runs again, but
+ * that window is a few us out of every frame and the bus has the other CAN_TX_HW_DEPTH frame to get on with.
+ * Caller must not hold the lock.
+ */
+static void can_tx_feed() {
+  critical_section_enter_blocking(&can_tx_lock);
+  if(can_tx_feeding) {
+    critical_section_exit(&can_tx_lock);
+    return;
+  }
+  can_tx_feeding = true;
+  while(can_tx_count > 0 && can_tx_hw_count < CAN_TX_HW_DEPTH && can2040_check_transmit(&cbus)) {
+    struct can2040_msg msg;
+    uint32_t tag;
+    can_tx_heap_pop(&msg, &tag);
+    can_tx_hw_tags[(can_tx_hw_head + can_tx_hw_count) % CAN_TX_HW_DEPTH] = tag;
+    can_tx_hw_count++;
+    critical_section_exit(&can_tx_lock);
+    can2040_transmit(&cbus, &msg);
+    critical_section_enter_blocking(&can_tx_lock);
+  }
+  can_tx_feeding = false;
+  critical_section_exit(&can_tx_lock);
+}
 
 bool can_can_send_msg() {
-  return can2040_check_transmit(&cbus);
+  return can_tx_count < CAN_TX_QUEUE_LENGTH;
 }
 
 // returns -1 if queue full
 int can_send_msg(struct can_msg *msg) {
-
   struct can2040_msg cmsg = {
     .id = msg->id,
     .dlc = msg->dlc,
     .data32 = {msg->data32[0], msg->data32[1]}
   };
-  vTaskSuspendAll();
-  int res = can2040_transmit(&cbus, &cmsg);
-  xTaskResumeAll();
-  return res;
+  critical_section_enter_blocking(&can_tx_lock);
+  bool queued = can_tx_heap_push(&cmsg, msg->tag);
+  critical_section_exit(&can_tx_lock);
+  can_tx_feed();
+  return queued ? 0 : -1;
+}
+
+// Queues a whole batch before feeding can2040 so the frames go out back to back, taking the lock CAN_TX_LOCK_BATCH
+// frames at a time. Returns how many made it into the queue.
+size_t can_send_msgs(const struct can_msg *msgs, size_t count) {
+  size_t queued = 0;
+  for(size_t i = 0; i < count;) {
+    size_t end = i + CAN_TX_LOCK_BATCH < count ? i + CAN_TX_LOCK_BATCH : count;
+    critical_section_enter_blocking(&can_tx_lock);
+    for(; i < end; i++) {
+      struct can2040_msg cmsg = {
+        .id = msgs[i].id,
+        .dlc = msgs[i].dlc,
+        .data32 = {msgs[i].data32[0], msgs[i].data32[1]}
+      };
+      if(can_tx_heap_push(&cmsg, msgs[i].tag)) queued++;
+    }
+    critical_section_exit(&can_tx_lock);
+  }
+  can_tx_feed();
+  return queued;
+}
+
+void can_init() {
+  critical_section_init(&can_tx_lock);
 }
 
-static fifo_t can_recv_queue;
-static bool can_recv_notify = false;
+// Big enough to soak up a few ms of back-to-back frames at 1 Mbit while can_task is busy
+#define CAN_RX_QUEUE_SIZE 256
+// How many frames can_task pulls off the ring before handing them to the consumers
+#define CAN_RX_BATCH_SIZE 32
+
+static spsc_fifo<struct can_msg, CAN_RX_QUEUE_SIZE> can_recv_queue;
+// frames can2040 finished sending, for gs_usb echoes
+static spsc_fifo<struct can_msg, CAN_RX_QUEUE_SIZE> can_tx_done_queue;
+static TaskHandle_t can_task_handle = NULL;
 
 static void can2040_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg) {
+  // grab this first so the stamp is as close to the end of frame as we can get
+  uint32_t now = time_us_32();
   struct can_msg cmsg = {
     .id = msg->id,
     .dlc = msg->dlc,
-    .data32 = {msg->data32[0], msg->data32[1]}
+    .data32 = {msg->data32[0], msg->data32[1]},
+    .timestamp_us = now
   };
   switch(notify) {
-    case CAN2040_NOTIFY_RX:
+    case CAN2040_NOTIFY_RX: {
       // printf("CAN RX: %08X %08X %08X\n", cmsg.id, cmsg.data32[0], cmsg.data32[1]);
-      fifo_enqueue(&can_recv_queue, cmsg);
-      can_recv_notify = true;
+      can_recv_queue.push(cmsg);
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR(can_task_handle, &woken);
+      portYIELD_FROM_ISR(woken);
       break;
-    case CAN2040_NOTIFY_TX:
+    }
+    case CAN2040_NOTIFY_TX: {
       // printf("CAN TX: %08X %08X %08X success\n", msg->id, msg->data32[0], msg->data32[1]);
+      critical_section_enter_blocking(&can_tx_lock);
+      if(can_tx_hw_count > 0) {
+        cmsg.tag = can_tx_hw_tags[can_tx_hw_head];
+        can_tx_hw_head = (can_tx_hw_head + 1) % CAN_TX_HW_DEPTH;
+        can_tx_hw_count--;
+      }
+      critical_section_exit(&can_tx_lock);
+      can_tx_feed();
+
+      can_tx_done_queue.push(cmsg);
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR(can_task_handle, &woken);
+      portYIELD_FROM_ISR(woken);
       break;
+    }
     case CAN2040_NOTIFY_ERROR:
       // printf("CAN ERROR BRUH MOMENT\n");
       break;
@@ -64,7 +237,7 @@ static void PIOx_IRQHandler(void) {
 void can_task(void* params) {
   uint32_t bitrate = 1000000;
   uint32_t gpio_tx = 6, gpio_rx = 7;
-  fifo_init(&can_recv_queue);
+  can_task_handle = xTaskGetCurrentTaskHandle();
 
   can2040_setup(&cbus, CAN2040_PIO_NUM);
   can2040_callback_config(&cbus, can2040_cb);
@@ -76,15 +249,137 @@ void can_task(void* params) {
   can2040_start(&cbus, CUR_SYS_CLK, bitrate, gpio_rx, gpio_tx);
 
   while(1) {
-    if(can_recv_notify == true) {
-      // printf("we recieved some stuff (queue size is %d)\n", fifo_size(&can_recv_queue));
-      struct can_msg out = {0};
-      fifo_dequeue(&can_recv_queue, &out);
-      // printf("CAN RX: %08X %08X %08X\n", out.id, out.data32[0], out.data32[1]);
-      rev_can_frame_callback(&out);
-      gs_usb_send_can_frame(&out);
-      can_recv_notify = false;
+    // the ISR gives one notification per frame, but we just drain whatever is there each time we wake up
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    struct can_msg batch[CAN_RX_BATCH_SIZE];
+    uint32_t n;
+    while((n = can_recv_queue.pop_n(batch, CAN_RX_BATCH_SIZE)) > 0) {
+      rev_can_frames_callback(batch, n);
+      gs_usb_send_can_frames(batch, n);
+    }
+    // our own frames (and the host's) go through the decoder too once they've actually been on the bus
+    while((n = can_tx_done_queue.pop_n(batch, CAN_RX_BATCH_SIZE)) > 0) {
+      rev_can_frames_callback(batch, n);
+      gs_usb_can_tx_done(batch, n);
     }
-    vTaskDelay(5);
   }
+}
+
+static BaseType_t can_stats_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  struct can2040_stats stats;
+  can2040_get_statistics(&cbus, &stats);
+  snprintf(pcWriteBuffer, xWriteBufferLen,
+    "rx_total: %u tx_total: %u tx_attempt: %u parse_error: %u\r\n"
+    "rx queue: %u/%u queued, high water %u, overflows %u\r\n"
+    "tx done queue overflows: %u\r\n"
+    "tx queue: %u/%u queued, drops by priority class (api or id top bits): %u %u %u %u %u %u %u %u\r\n",
+    stats.rx_total, stats.tx_total, stats.tx_attempt, stats.parse_error,
+    can_recv_queue.size(), CAN_RX_QUEUE_SIZE, can_recv_queue.high_water.load(), can_recv_queue.overflows.load(),
+    can_tx_done_queue.overflows.load(),
+    can_tx_count, CAN_TX_QUEUE_LENGTH, can_tx_drops[0], can_tx_drops[1], can_tx_drops[2], can_tx_drops[3],
+    can_tx_drops[4], can_tx_drops[5], can_tx_drops[6], can_tx_drops[7]);
+  return pdFALSE;
+}
+
+static const CLI_Command_Definition_t xCanStatsCommand = {
+  "can",
+  "can: Show CAN bus and receive queue statistics\r\n",
+  can_stats_command,
+  0
+};
+
+// Worst time over a few runs to push and then pop that many frames with the lock held once, skipping runs where real
+// traffic was queued. 0 if it never found the queue empty.
+static uint32_t can_bench_lock_hold(const struct can2040_msg *msg, uint32_t frames) {
+  uint32_t worst = 0;
+  for(int run = 0; run < 100; run++) {
+    struct can2040_msg out;
+    uint32_t tag;
+    critical_section_enter_blocking(&can_tx_lock);
+    if(can_tx_count != 0) {
+      critical_section_exit(&can_tx_lock);
+      continue;
+    }
+    uint32_t start = time_us_32();
+    for(uint32_t i = 0; i < frames; i++) can_tx_heap_push(msg, 0);
+    while(can_tx_count > 0) can_tx_heap_pop(&out, &tag);
+    uint32_t held = time_us_32() - start;
+    critical_section_exit(&can_tx_lock);
+    if(held > worst) worst = held;
+  }
+  return worst;
+}
+
+/* Rough per-send cost of the ways we've guarded the tx path: the old vTaskSuspendAll() pair, a kernel critical
+ * section, and the spin lock we use now, plus what a full enqueue + dequeue through the heap costs under it.
+ * Doesn't put anything on the bus.
+ */
+static BaseType_t can_bench_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  const uint32_t n = 1000;
+  struct can2040_msg msg = { .id = 0x2050080 | CAN2040_ID_EFF, .dlc = 8 };
+
+  uint64_t start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    vTaskSuspendAll();
+    xTaskResumeAll();
+  }
+  uint64_t suspend_all = time_us_64() - start;
+
+  start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    taskENTER_CRITICAL();
+    taskEXIT_CRITICAL();
+  }
+  uint64_t kernel_critical = time_us_64() - start;
+
+  start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    critical_section_enter_blocking(&can_tx_lock);
+    critical_section_exit(&can_tx_lock);
+  }
+  uint64_t spin_lock = time_us_64() - start;
+
+  start = time_us_64();
+  uint32_t queued = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    struct can2040_msg out;
+    uint32_t tag;
+    critical_section_enter_blocking(&can_tx_lock);
+    // only when the queue is empty, so the pop is guaranteed to hand back our frame and not a real one
+    if(can_tx_count == 0 && can_tx_heap_push(&msg, 0)) {
+      can_tx_heap_pop(&out, &tag);
+      queued++;
+    }
+    critical_section_exit(&can_tx_lock);
+  }
+  uint64_t enqueue = time_us_64() - start;
+
+  // longest the lock (and so irqs on this core) stays held by can_send_msgs: one CAN_TX_LOCK_BATCH chunk of pushes,
+  // against a whole 32 frame batch in one go like it used to. The pops are in there too so the queue ends up empty.
+  uint32_t chunk_max = can_bench_lock_hold(&msg, CAN_TX_LOCK_BATCH);
+  uint32_t batch_max = can_bench_lock_hold(&msg, 32);
+
+  snprintf(pcWriteBuffer, xWriteBufferLen,
+    "ns per op over %u runs:\r\n"
+    "vTaskSuspendAll+xTaskResumeAll: %u\r\n"
+    "taskENTER/EXIT_CRITICAL: %u\r\n"
+    "critical_section enter/exit: %u\r\n"
+    "heap push + pop under critical_section: %u (%u/%u runs found the queue empty)\r\n"
+    "max lock hold, us: %u frame chunk %u, 32 frames %u\r\n",
+    n, (uint32_t) (suspend_all * 1000 / n), (uint32_t) (kernel_critical * 1000 / n),
+    (uint32_t) (spin_lock * 1000 / n), (uint32_t) (enqueue * 1000 / n), queued, n,
+    CAN_TX_LOCK_BATCH, chunk_max, batch_max);
+  return pdFALSE;
+}
+
+static const CLI_Command_Definition_t xCanBenchCommand = {
+  "canbench",
+  "canbench: Time the CAN tx path locking and queueing\r\n",
+  can_bench_command,
+  0
+};
+
+void can_register_commands() {
+  FreeRTOS_CLIRegisterCommand(&xCanStatsCommand);
+  FreeRTOS_CLIRegisterCommand(&xCanBenchCommand);
 }
\ No newline at end of file
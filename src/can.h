@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 struct can_msg {
@@ -8,8 +9,13 @@ struct can_msg {
         uint8_t data[8];
         uint32_t data32[2];
     };
+    uint32_t timestamp_us; // time_us_32() when the frame came off (or went onto) the bus
+    uint32_t tag; // whoever queued the frame picks it (0 for the firmware's own), and gets it back on the tx done frame
 };
 
+void can_init();
 void can_task(void* params);
+void can_register_commands();
 bool can_can_send_msg();
-int can_send_msg(struct can_msg *msg);
\ No newline at end of file
+int can_send_msg(struct can_msg *msg);
+size_t can_send_msgs(const struct can_msg *msgs, size_t count);
\ No newline at end of file
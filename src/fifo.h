@@ -1,18 +1,73 @@
 #pragma once
-#include "can.h"
-
-#define FIFO_SIZE 4
-
-typedef struct {
-    struct can_msg buffer[FIFO_SIZE];
-    int head;
-    int tail;
-    int count;
-} fifo_t;
-
-void fifo_init(fifo_t *fifo);
-bool fifo_is_full(fifo_t *fifo);
-bool fifo_is_empty(fifo_t *fifo);
-bool fifo_enqueue(fifo_t *fifo, struct can_msg data);
-bool fifo_dequeue(fifo_t *fifo, struct can_msg* data_out);
-int fifo_size(fifo_t *fifo);
\ No newline at end of file
+#include <atomic>
+#include <cstdint>
+
+// Lock-free single-producer/single-consumer ring.
+// head is only ever written by the consumer and tail only by the producer, so the CAN ISR can push while a task
+// drains without either side masking interrupts. Both indices free-run and are masked on access, which is why
+// SIZE has to be a power of two (it also means we never need a shared count).
+template <typename T, uint32_t SIZE>
+struct spsc_fifo {
+    static_assert(SIZE != 0 && (SIZE & (SIZE - 1)) == 0, "fifo size must be a power of two");
+    static constexpr uint32_t MASK = SIZE - 1;
+
+    T buffer[SIZE];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+
+    // Written by the producer only, readable from anywhere
+    std::atomic<uint32_t> overflows{0};  // items dropped because the ring was full
+    std::atomic<uint32_t> high_water{0}; // most items ever queued at once
+
+    // Producer side (ISR safe)
+    bool push(const T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t used = t - head.load(std::memory_order_acquire);
+        if (used >= SIZE) {
+            overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        buffer[t & MASK] = item;
+        tail.store(t + 1, std::memory_order_release);
+        if (used + 1 > high_water.load(std::memory_order_relaxed)) {
+            high_water.store(used + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T* out) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        *out = buffer[h & MASK];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Pops up to max items in one go, returns how many were copied out
+    uint32_t pop_n(T* out, uint32_t max) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t n = tail.load(std::memory_order_acquire) - h;
+        if (n > max) {
+            n = max;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            out[i] = buffer[(h + i) & MASK];
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    uint32_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool is_empty() const {
+        return size() == 0;
+    }
+};
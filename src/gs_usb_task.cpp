@@ -1,15 +1,29 @@
+#include <cstring>
 #include "gs_usb_task.h"
 #include "pico/stdlib.h"
+#include "hardware/timer.h"
 #include "tusb.h"
 #include "FreeRTOS.h"
 #include "task.h"
+#include "pico/sync.h"
 #include "can.h"
-#include "rev.h"
+#include "fifo.h"
+#include "FreeRTOS-Plus-CLI/FreeRTOS_CLI.h"
 
 static struct gs_host_config config;
 static struct gs_device_bittiming bt;
 static struct gs_device_mode mode;
 
+// gs_usb_task sleeps until something (usb callbacks, a producer queueing a frame, a can tx completing) pokes it
+static TaskHandle_t gs_usb_task_handle = NULL;
+
+static void gs_usb_wake() {
+  if(gs_usb_task_handle != NULL) xTaskNotifyGive(gs_usb_task_handle);
+}
+
+// set from the control request handler, handled by gs_usb_task since it owns the echo table
+static volatile bool echo_reset_requested = false;
+
 static struct gs_device_config device_config = {
     .sw_version = 2,
     .hw_version = 1,
@@ -17,7 +31,8 @@ static struct gs_device_config device_config = {
 
 static struct gs_device_bt_const bt_const = {
     // These are just dummy values for now. linux don't even use them for anything lmao
-    .feature = 0,
+    // (except feature, that one decides which mode flags the host will ask for)
+    .feature = GS_CAN_FEATURE_HW_TIMESTAMP,
     .fclk_can = 48000000,
     .tseg1_min = 1,
     .tseg1_max = 16,
@@ -70,11 +85,33 @@ static void gs_breq_mode(uint8_t rhport, uint8_t stage, tusb_control_request_t c
     tud_control_xfer(rhport, req, &mode, sizeof(mode));
     return;
   } else if(stage == CONTROL_STAGE_ACK) {
+    // flags only mean something while the channel is started; after a reset go back to plain 20 byte frames
+    // and forget about any echoes the host has stopped waiting for
+    if(mode.mode == GS_CAN_MODE_RESET) {
+      mode.flags = 0;
+      echo_reset_requested = true;
+      gs_usb_wake();
+    }
     printf("Mode: %d %d\n", mode.mode, mode.flags);
     return;
   }
 }
 
+// The host polls this to keep its copy of our 32 bit us counter from wrapping unnoticed
+static uint32_t device_timestamp;
+
+static void gs_breq_timestamp(uint8_t rhport, uint8_t stage, tusb_control_request_t const * req) {
+  if(stage == CONTROL_STAGE_SETUP) {
+    device_timestamp = time_us_32();
+    tud_control_xfer(rhport, req, &device_timestamp, sizeof(device_timestamp));
+    return;
+  }
+}
+
+// How many bytes a device -> host frame takes on the wire right now
+static size_t gs_usb_frame_size() {
+  return (mode.mode == GS_CAN_MODE_START && (mode.flags & GS_CAN_MODE_HW_TIMESTAMP)) ? GS_HOST_FRAME_TS_SIZE : GS_HOST_FRAME_SIZE;
+}
 
 static int runCount = 0;
 
@@ -103,6 +140,7 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
     case GS_USB_BREQ_BT_CONST: gs_breq_bt_const(rhport, stage, req); break;
     case GS_USB_BREQ_BITTIMING: gs_breq_bittiming(rhport, stage, req); break;
     case GS_USB_BREQ_MODE: gs_breq_mode(rhport, stage, req); break;
+    case GS_USB_BREQ_TIMESTAMP: gs_breq_timestamp(rhport, stage, req); break;
     default:
       printf("Unknown bRequest: %d %d %d %d\n", req->bRequest, req->wValue, req->wIndex, req->wLength);
       return false;
@@ -112,86 +150,268 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
 
 static bool recv_thing = false;
 
+// The TinyUSB in pico-sdk 2.0.0 only passes the interface. It has to match the weak declaration exactly, otherwise
+// this is just a C++ overload nobody calls
+void tud_vendor_rx_cb(uint8_t itf) {
+  gs_usb_wake();
+}
+
 void tud_vendor_tx_cb(uint8_t itf, uint32_t sent_bytes) {
   // printf("Sent %d bytes with interface %d\n", sent_bytes, itf);
+  gs_usb_wake();
 }
 
 // so the way it works is we send out frames with echo_id -1 and we have to echo back frames we recieve with their own echo id to ack them.
 
-static struct gs_host_frame [[gnu::packed]] frame = {
-      .echo_id = -1,
-      .can_id = 0x123,
-      .can_dlc = 8,
+/* Frames headed for the host go out one per bulk IN packet. Stock linux gs_usb submits IN urbs exactly one frame
+ * long, so packing several frames into a packet would just overflow them.
+ *
+ * Any task can submit frames (can_task, rev heartbeats, the pid loop...), but only gs_usb_task ever touches TinyUSB.
+ * Producers copy their frames (a whole batch at a time from can_task) into gs_usb_tx_queue under gs_usb_tx_lock
+ * without waiting, and wake the task once per batch. Holding the lock makes them a single producer as far as the
+ * ring is concerned, and gs_usb_task is the only consumer so it pops without the lock.
+ * A frame only goes into the vendor fifo once the fifo is empty, otherwise TinyUSB would happily glue the next
+ * frame onto the tail of this one into a single packet when the endpoint frees up.
+ */
+#define GS_USB_TX_QUEUE_LENGTH 128
+
+static spsc_fifo<struct gs_host_frame, GS_USB_TX_QUEUE_LENGTH> gs_usb_tx_queue; // overflows counts dropped frames
+static critical_section_t gs_usb_tx_lock;
+
+static struct {
+  uint32_t frames;
+} tx_stats;
+
+void gs_usb_init() {
+  critical_section_init(&gs_usb_tx_lock);
+}
+
+// Producer side, safe from any task. Never blocks; if the writer has fallen that far behind the frame is dropped.
+static void gs_usb_queue_frame(const struct gs_host_frame *frame) {
+  critical_section_enter_blocking(&gs_usb_tx_lock);
+  gs_usb_tx_queue.push(*frame);
+  critical_section_exit(&gs_usb_tx_lock);
+  gs_usb_wake();
+}
+
+// Everything below is only called from gs_usb_task
+
+static void gs_usb_tx_service() {
+  struct gs_host_frame frame;
+  // tud_vendor_tx_cb wakes us once the endpoint is free again, whatever is left just waits in the queue till then
+  while(tud_vendor_n_write_available(0) >= CFG_TUD_VENDOR_TX_BUFSIZE && gs_usb_tx_queue.pop(&frame)) {
+    tud_vendor_n_write(0, &frame, gs_usb_frame_size());
+    tud_vendor_n_write_flush(0);
+    tx_stats.frames++;
+  }
+}
+
+// The whole span goes in under one lock and gs_usb_task gets woken once for it, not once per frame
+void gs_usb_send_can_frames(struct can_msg *msgs, size_t count) {
+  critical_section_enter_blocking(&gs_usb_tx_lock);
+  for(size_t i = 0; i < count; i++) {
+    gs_usb_tx_queue.push({
+      .echo_id = 0xFFFFFFFF,
+      .can_id = msgs[i].id,
+      .can_dlc = (uint8_t) msgs[i].dlc,
+      .channel = 0,
       .flags = 0,
       .reserved = 0,
-      .data = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08}
-};
+      .data32 = {msgs[i].data32[0], msgs[i].data32[1]},
+      .timestamp_us = msgs[i].timestamp_us
+    });
+  }
+  critical_section_exit(&gs_usb_tx_lock);
+  gs_usb_wake();
+}
 
 void gs_usb_send_can_frame(struct can_msg *msg) {
-  frame.can_id = msg->id;
-  frame.can_dlc = msg->dlc;
-  frame.data32[0] = msg->data32[0];
-  frame.data32[1] = msg->data32[1];
-  tud_vendor_n_write(0, &frame, sizeof(frame));
-  tud_vendor_n_write_flush(0);
+  gs_usb_send_can_frames(msg, 1);
 }
 
-void gs_usb_task(__unused void *params) {
-  gs_host_frame frame_buf[20] = {0};
+/* Host -> bus. Host frames go out on the bus for real, and their echo (which is what tells the host the frame is
+ * done and frees its tx context) only goes back once can2040 says the frame actually made it onto the wire.
+ * Until then the frame sits in echo_table. When the table is full, or the can tx queue is, we stop reading from
+ * the OUT endpoint and let USB NAK the host until something completes.
+ */
+#define GS_USB_MAX_INFLIGHT 16
+#define GS_USB_TX_DONE_QUEUE_SIZE 64
+#define GS_USB_TX_DONE_BATCH 16
+#define GS_USB_ECHO_LOST_US 50000 // a frame this old that was queued before a tx done overflow isn't coming back
+
+static struct {
+  struct gs_host_frame frame;
+  uint32_t seq;
+  uint32_t queued_us;
+  bool used;
+} echo_table[GS_USB_MAX_INFLIGHT];
+static uint32_t echo_seq = 1; // also the frame's can_msg tag, so never 0
+
+// When the tx done queue overflows we can't tell whose completion got dropped, so everything queued before that
+// point gets echoed anyway once it's old enough, rather than holding its slot forever
+static uint32_t tx_done_overflows_seen = 0;
+static uint32_t echo_lost_before_seq = 0;
+static bool echo_lost_pending = false;
+
+// a frame we've read from the host but couldn't hand to the can driver yet
+static struct gs_host_frame host_pending;
+static bool host_pending_valid = false;
+
+// can_task -> gs_usb_task
+static spsc_fifo<struct can_msg, GS_USB_TX_DONE_QUEUE_SIZE> gs_usb_tx_done_queue;
+
+void gs_usb_can_tx_done(struct can_msg *msgs, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    gs_usb_tx_done_queue.push(msgs[i]);
+  }
+  gs_usb_wake();
+}
+
+static bool gs_usb_forward_host_frame(struct gs_host_frame *frame) {
+  int free_slot = -1;
+  for(int i = 0; i < GS_USB_MAX_INFLIGHT; i++) {
+    if(!echo_table[i].used) {
+      free_slot = i;
+      break;
+    }
+  }
+  if(free_slot < 0) return false;
+
+  struct can_msg msg = {
+    .id = frame->can_id & ~GS_CAN_ERR_FLAG, // can2040 wants the same EFF/RTR bits linux uses
+    .dlc = frame->can_dlc,
+    .data32 = {frame->data32[0], frame->data32[1]},
+    .tag = echo_seq
+  };
+  if(can_send_msg(&msg) < 0) return false;
+
+  echo_table[free_slot].frame = *frame;
+  echo_table[free_slot].seq = echo_seq;
+  if(++echo_seq == 0) echo_seq = 1;
+  echo_table[free_slot].queued_us = time_us_32();
+  echo_table[free_slot].used = true;
+  return true;
+}
+
+static void gs_usb_rx_service() {
   while(1) {
-    if(!tud_inited()) continue;
-
-    if(uint32_t b = tud_vendor_n_available(0)) {
-      // printf("we have data available!! it's about %d uint32_t's long\n", b);
-      // struct gs_host_frame test_frame;
-      // tud_vendor_n_read(0, &test_frame, sizeof(test_frame));
-      // tud_vendor_n_read_flush(0);
-      // // printf("Received! frame!: %d %d %d %d %d %d %d %d %d\n", test_frame.echo_id, test_frame.can_id, test_frame.can_dlc,
-      // // test_frame.channel, test_frame.flags, test_frame.reserved, test_frame.data[0], test_frame.data[1], test_frame.data[2]);
-      // if(can_can_send_msg()) {
-      //   struct can_msg msg = {
-      //     .id = test_frame.can_id,
-      //     .dlc = test_frame.can_dlc,
-      //     .data32 = {test_frame.data32[0], test_frame.data32[1]}
-      //   };
-      //   // can_send_msg(&msg);
-      //   rev_can_frame_callback(&msg);
-      //   // echo back
-      //   tud_vendor_n_write(0, &test_frame, sizeof(test_frame));
-      //   tud_vendor_n_write_flush(0);
-      //   // printf("okie we sent it\n");
-      // } else {
-      //   printf("CAN TX queue full :(\n");
-      // }
-
-      while(b > 0) {
-        uint32_t n_read = tud_vendor_n_read(0, &frame_buf, sizeof(frame_buf));
-        // tud_vendor_n_read_flush(0);
-        // printf("b: %d n_read: %d\n", b, n_read);
-        for(int i = 0; i < n_read / sizeof(gs_host_frame); i++) {
-          struct gs_host_frame *recvd_frame = &frame_buf[i];
-          recvd_frame->can_id = recvd_frame->can_id & 0b0001'1111'1111'1111'1111'1111'1111'1111; // can id is 29 bits
-          struct can_msg msg = {
-            .id = recvd_frame->can_id,
-            .dlc = recvd_frame->can_dlc,
-            .data32 = {recvd_frame->data32[0], recvd_frame->data32[1]}
-          };
-          if(can_can_send_msg()) {
-            // can_send_msg(&msg);
-          } else {
-            printf("CAN TX queue full :( dropping frame i guess...\n");
-          }
-
-          rev_can_frame_callback(&msg);
-          // printf("msg id (hex): %08X   data: %02X %02X %02X %02X %02X %02X %02X %02X\n", recvd_frame->can_id, msg.data[0], msg.data[1], msg.data[2], msg.data[3], msg.data[4], msg.data[5], msg.data[6], msg.data[7]);
-          // echo back
-          tud_vendor_n_write(0, recvd_frame, sizeof(struct gs_host_frame));
-          // printf("okie we sent it\n");
-
-          tud_vendor_n_write_flush(0);
-        }
-        b -= n_read;
+    if(!host_pending_valid) {
+      // host -> device frames never carry a timestamp
+      if(tud_vendor_n_available(0) < GS_HOST_FRAME_SIZE) return;
+      host_pending = {};
+      tud_vendor_n_read(0, &host_pending, GS_HOST_FRAME_SIZE);
+      host_pending_valid = true;
+    }
+    if(!gs_usb_forward_host_frame(&host_pending)) return; // try again once something finishes transmitting
+    host_pending_valid = false;
+  }
+}
+
+static void gs_usb_echo(int slot, uint32_t timestamp_us) {
+  struct gs_host_frame echo = echo_table[slot].frame;
+  echo.timestamp_us = timestamp_us;
+  echo_table[slot].used = false;
+  gs_usb_queue_frame(&echo);
+}
+
+static void gs_usb_expire_lost_echoes() {
+  uint32_t overflows = gs_usb_tx_done_queue.overflows.load(std::memory_order_relaxed);
+  if(overflows != tx_done_overflows_seen) {
+    tx_done_overflows_seen = overflows;
+    echo_lost_before_seq = echo_seq;
+    echo_lost_pending = true;
+  }
+  if(!echo_lost_pending) return;
+
+  uint32_t now = time_us_32();
+  echo_lost_pending = false;
+  for(int i = 0; i < GS_USB_MAX_INFLIGHT; i++) {
+    if(!echo_table[i].used || (int32_t) (echo_table[i].seq - echo_lost_before_seq) >= 0) continue;
+    if(now - echo_table[i].queued_us >= GS_USB_ECHO_LOST_US) {
+      gs_usb_echo(i, now);
+    } else {
+      echo_lost_pending = true; // might still complete normally, look again later
+    }
+  }
+}
+
+// Host frames are matched to their echo slot on the tag we gave them, so one of our own frames that happens to look
+// identical can't take the host's echo
+static void gs_usb_tx_done_service() {
+  struct can_msg done[GS_USB_TX_DONE_BATCH];
+  // something of ours (heartbeats, setpoints...), shown to the host like any other bus traffic
+  struct can_msg ours[GS_USB_TX_DONE_BATCH];
+  uint32_t n;
+  while((n = gs_usb_tx_done_queue.pop_n(done, GS_USB_TX_DONE_BATCH)) > 0) {
+    size_t n_ours = 0;
+    for(uint32_t i = 0; i < n; i++) {
+      if(done[i].tag == 0) {
+        ours[n_ours++] = done[i];
+        continue;
+      }
+      for(int slot = 0; slot < GS_USB_MAX_INFLIGHT; slot++) {
+        if(!echo_table[slot].used || echo_table[slot].seq != done[i].tag) continue;
+        // keep the host's view in bus order
+        if(n_ours > 0) gs_usb_send_can_frames(ours, n_ours);
+        n_ours = 0;
+        gs_usb_echo(slot, done[i].timestamp_us);
+        break;
       }
+      // no slot means it was already echoed as lost, or the host reset the channel since
     }
+    if(n_ours > 0) gs_usb_send_can_frames(ours, n_ours);
   }
-}
\ No newline at end of file
+}
+
+static uint32_t gs_usb_inflight() {
+  uint32_t n = 0;
+  for(auto& slot : echo_table) n += slot.used;
+  return n;
+}
+
+static BaseType_t gs_usb_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  snprintf(pcWriteBuffer, xWriteBufferLen,
+    "frames: %u dropped: %u queued: %u\r\n"
+    "echoes in flight: %u/%u, tx done overflows: %u\r\n",
+    tx_stats.frames, gs_usb_tx_queue.overflows.load(), gs_usb_tx_queue.size(),
+    gs_usb_inflight(), GS_USB_MAX_INFLIGHT, gs_usb_tx_done_queue.overflows.load());
+  return pdFALSE;
+}
+
+static const CLI_Command_Definition_t xGsUsbCommand = {
+  "gsu",
+  "gsu: Show gs_usb frame and echo counters\r\n",
+  gs_usb_command,
+  0
+};
+
+void gs_usb_register_commands() {
+  FreeRTOS_CLIRegisterCommand(&xGsUsbCommand);
+}
+
+void gs_usb_task(__unused void *params) {
+  gs_usb_task_handle = xTaskGetCurrentTaskHandle();
+  while(!tud_inited()) vTaskDelay(1);
+
+  while(1) {
+    if(echo_reset_requested) {
+      echo_reset_requested = false;
+      for(auto& slot : echo_table) slot.used = false;
+      host_pending_valid = false;
+      echo_lost_pending = false;
+    }
+
+    // completions first, they free up echo slots and room in the can tx queue for the host's frames
+    gs_usb_tx_done_service();
+    gs_usb_expire_lost_echoes();
+    gs_usb_rx_service();
+    gs_usb_tx_service();
+
+    // Everything that makes work for us notifies: the usb rx/tx callbacks, frame producers, can tx completions
+    // (which also free up echo slots and can tx queue room for a stalled host frame) and mode changes. The one
+    // thing nothing signals is an echo whose completion got lost to a tx done overflow going stale, so only wake on
+    // a timer while one of those is waiting to be expired. Goes at the bottom so anything queued before we set
+    // gs_usb_task_handle gets picked up on the first pass.
+    ulTaskNotifyTake(pdTRUE, echo_lost_pending ? pdMS_TO_TICKS(GS_USB_ECHO_LOST_US / 1000) : portMAX_DELAY);
+  }
+}
@@ -1,9 +1,15 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 #include "pico/stdlib.h"
+#include "can.h"
 
+void gs_usb_init();
 void gs_usb_task(void *params);
 void gs_usb_send_can_frame(struct can_msg *msg);
+void gs_usb_send_can_frames(struct can_msg *msgs, size_t count);
+void gs_usb_can_tx_done(struct can_msg *msgs, size_t count);
+void gs_usb_register_commands();
 
 enum gs_usb_breq {
     GS_USB_BREQ_HOST_FORMAT = 0,
@@ -60,6 +66,18 @@ struct gs_device_mode {
     uint32_t flags;
 } __packed;
 
+enum gs_can_mode {
+    GS_CAN_MODE_RESET = 0,
+    GS_CAN_MODE_START,
+};
+
+#define GS_CAN_MODE_HW_TIMESTAMP (1 << 4)
+
+#define GS_CAN_FEATURE_HW_TIMESTAMP (1 << 4)
+
+#define GS_CAN_ERR_FLAG 0x20000000
+#define GS_CAN_RTR_FLAG 0x40000000
+
 struct gs_host_frame {
     uint32_t echo_id;
     uint32_t can_id;
@@ -73,4 +91,10 @@ struct gs_host_frame {
         uint8_t data[8];
         uint32_t data32[2];
     };
+
+    // Only on the wire for device -> host frames, and only while the host has GS_CAN_MODE_HW_TIMESTAMP set
+    uint32_t timestamp_us;
 } __packed;
+
+#define GS_HOST_FRAME_SIZE offsetof(struct gs_host_frame, timestamp_us)
+#define GS_HOST_FRAME_TS_SIZE sizeof(struct gs_host_frame)
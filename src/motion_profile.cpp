@@ -0,0 +1,159 @@
+#include "motion_profile.h"
+#include <algorithm>
+#include <cmath>
+
+// Enough to pin the cruise velocity down to well under a part in a million of max_velocity
+#define MOTION_PROFILE_BISECT_STEPS 24
+
+static motion_profile_ramp motion_profile_make_ramp(const motion_profile_limits* limits, float v0, float v1) {
+  motion_profile_ramp ramp = {};
+  float dv = std::fabs(v1 - v0);
+  ramp.v0 = v0;
+  ramp.sign = v1 >= v0 ? 1.0f : -1.0f;
+  if(dv == 0) return ramp;
+  float a = limits->max_acceleration;
+  if(limits->max_jerk > 0) {
+    float j = limits->max_jerk;
+    ramp.jerk = j;
+    if(dv >= a * a / j) {
+      // reaches max acceleration: ramp up, hold, ramp down
+      ramp.peak_accel = a;
+      ramp.jerk_time = a / j;
+      ramp.duration = dv / a + a / j;
+    } else {
+      // too short a change to get there, pure jerk up then down
+      ramp.peak_accel = std::sqrt(dv * j);
+      ramp.jerk_time = ramp.peak_accel / j;
+      ramp.duration = 2 * ramp.jerk_time;
+    }
+  } else {
+    ramp.peak_accel = a;
+    ramp.duration = dv / a;
+  }
+  ramp.distance = (v0 + v1) / 2 * ramp.duration;
+  return ramp;
+}
+
+// Offset from the start of the ramp at time t into it
+static motion_profile_point motion_profile_eval_ramp(const motion_profile_ramp* ramp, float t) {
+  float s = ramp->sign;
+  float j = ramp->jerk;
+  float a = ramp->peak_accel;
+  float tj = ramp->jerk_time;
+  float hold = ramp->duration - 2 * tj;
+  motion_profile_point p = {0, ramp->v0, 0};
+  // jerk up
+  float t1 = std::min(t, tj);
+  p.position += p.velocity * t1 + s * j * t1 * t1 * t1 / 6;
+  p.velocity += s * j * t1 * t1 / 2;
+  p.acceleration = s * j * t1;
+  if(t <= tj) return p;
+  // hold
+  float t2 = std::min(t - tj, hold);
+  p.position += p.velocity * t2 + s * a * t2 * t2 / 2;
+  p.velocity += s * a * t2;
+  p.acceleration = s * a;
+  if(t <= tj + hold) return p;
+  // jerk down
+  float t3 = std::min(t - tj - hold, tj);
+  p.position += p.velocity * t3 + s * (a * t3 * t3 / 2 - j * t3 * t3 * t3 / 6);
+  p.velocity += s * (a * t3 - j * t3 * t3 / 2);
+  p.acceleration = s * (a - j * t3);
+  if(t >= ramp->duration) p.acceleration = 0;
+  return p;
+}
+
+static float motion_profile_plan_distance(const motion_profile_limits* limits, float v0, float cruise) {
+  return motion_profile_make_ramp(limits, v0, cruise).distance + motion_profile_make_ramp(limits, cruise, 0).distance;
+}
+
+void motion_profile_init(motion_profile* profile, const motion_profile_limits* limits, float position) {
+  *profile = {};
+  profile->limits = *limits;
+  profile->goal = position;
+  profile->start = position;
+  profile->direction = 1;
+  profile->current.position = position;
+  profile->done = true;
+}
+
+void motion_profile_set_goal(motion_profile* profile, float goal) {
+  const motion_profile_limits* limits = &profile->limits;
+  // plan from the current velocity but zero acceleration, so an S-curve replanned mid-ramp takes one step in jerk
+  motion_profile_point from = profile->current;
+  profile->goal = goal;
+  profile->start = from.position;
+  profile->t = 0;
+  profile->done = false;
+  profile->replan_at_end = false;
+  profile->direction = goal > from.position || (goal == from.position && from.velocity < 0) ? 1.0f : -1.0f;
+  float distance = (goal - from.position) * profile->direction;
+  float v0 = from.velocity * profile->direction;
+
+  if(v0 > 0 && motion_profile_make_ramp(limits, v0, 0).distance > distance) {
+    // can't stop in time, just stop and come back
+    profile->accel = motion_profile_make_ramp(limits, v0, 0);
+    profile->cruise_velocity = 0;
+    profile->cruise_time = 0;
+    profile->decel = motion_profile_make_ramp(limits, 0, 0);
+    profile->replan_at_end = true;
+    return;
+  }
+
+  float vmax = limits->max_velocity;
+  float cruise = vmax;
+  if(motion_profile_plan_distance(limits, v0, vmax) > distance) {
+    // won't reach max velocity, find the fastest we can get to and still stop at the goal. Starting above max
+    // velocity (the limit just got turned down), slowing to it first can take further than stopping outright with a
+    // jerk limit, so search all the way down. Stopping outright always fits, we checked above.
+    float lo = v0 > vmax ? 0.0f : std::max(v0, 0.0f);
+    float hi = vmax;
+    for(int i = 0; i < MOTION_PROFILE_BISECT_STEPS; i++) {
+      float mid = (lo + hi) / 2;
+      if(motion_profile_plan_distance(limits, v0, mid) > distance) hi = mid;
+      else lo = mid;
+    }
+    cruise = lo;
+  }
+  profile->accel = motion_profile_make_ramp(limits, v0, cruise);
+  profile->decel = motion_profile_make_ramp(limits, cruise, 0);
+  profile->cruise_velocity = cruise;
+  float left = distance - profile->accel.distance - profile->decel.distance;
+  profile->cruise_time = cruise > 0 ? std::max(0.0f, left / cruise) : 0;
+}
+
+motion_profile_point motion_profile_step(motion_profile* profile, float dt) {
+  if(profile->done) return profile->current;
+  profile->t += dt;
+  float t = profile->t;
+  float cruise_end = profile->accel.duration + profile->cruise_time;
+  float end = cruise_end + profile->decel.duration;
+
+  motion_profile_point p;
+  if(t < profile->accel.duration) {
+    p = motion_profile_eval_ramp(&profile->accel, t);
+  } else if(t < cruise_end) {
+    p.position = profile->accel.distance + profile->cruise_velocity * (t - profile->accel.duration);
+    p.velocity = profile->cruise_velocity;
+    p.acceleration = 0;
+  } else {
+    p = motion_profile_eval_ramp(&profile->decel, std::min(t, end) - cruise_end);
+    p.position += profile->accel.distance + profile->cruise_velocity * profile->cruise_time;
+  }
+
+  profile->current.position = profile->start + p.position * profile->direction;
+  profile->current.velocity = p.velocity * profile->direction;
+  profile->current.acceleration = p.acceleration * profile->direction;
+  if(t >= end) {
+    profile->current.velocity = 0;
+    profile->current.acceleration = 0;
+    if(profile->replan_at_end) {
+      motion_profile_set_goal(profile, profile->goal);
+    } else {
+      // land exactly, float error over a long cruise shouldn't leave us a hair off
+      profile->current.position = profile->goal;
+      profile->done = true;
+    }
+  }
+  return profile->current;
+}
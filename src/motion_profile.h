@@ -0,0 +1,49 @@
+#pragma once
+
+// Trapezoidal (max_jerk <= 0) or S-curve motion profiles, host buildable like pid.h.
+// Setting a goal plans from wherever the profile currently is, including mid-move, in a fixed number of steps.
+// Each step after that is a handful of float ops.
+
+struct motion_profile_limits {
+  float max_velocity; // units/s
+  float max_acceleration; // units/s^2
+  float max_jerk; // units/s^3, <= 0 for a plain trapezoid
+};
+
+struct motion_profile_point {
+  float position;
+  float velocity;
+  float acceleration;
+};
+
+// One velocity change, from v0 by dv, with the acceleration ramped at the jerk limit (or stepped for trapezoids).
+// The acceleration curve is symmetric so the distance covered is always just the average velocity times duration.
+struct motion_profile_ramp {
+  float v0;
+  float sign; // direction of the velocity change
+  float peak_accel;
+  float jerk; // 0 for trapezoids
+  float jerk_time; // time spent ramping the acceleration up (and again down)
+  float duration;
+  float distance;
+};
+
+struct motion_profile {
+  motion_profile_limits limits;
+  float goal;
+  // current plan, in a frame where the goal is in the +ve direction from start
+  float start;
+  float direction;
+  motion_profile_ramp accel;
+  float cruise_velocity;
+  float cruise_time;
+  motion_profile_ramp decel;
+  bool replan_at_end; // we were going too fast to stop at the goal, this plan just stops and then we go again
+  float t;
+  bool done;
+  motion_profile_point current;
+};
+
+void motion_profile_init(motion_profile* profile, const motion_profile_limits* limits, float position);
+void motion_profile_set_goal(motion_profile* profile, float goal);
+motion_profile_point motion_profile_step(motion_profile* profile, float dt);
@@ -22,6 +22,7 @@
 #include "disp_config.h"
 #include "consts.h"
 #include "rev.h"
+#include "telemetry.h"
 #include "can.h"
 #include "quadrature.pio.h"
 
@@ -111,6 +112,51 @@ static const CLI_Command_Definition_t xTasksCommand =
     0
 };
 
+/* CPU use per task since the last time this was run (or since boot), from the run time stats. Run it once, let
+ * things settle, and run it again to see what a change did to the idle tasks.
+ */
+#define STATS_MAX_TASKS 24
+
+static TaskStatus_t stats_tasks[STATS_MAX_TASKS];
+static struct {
+    UBaseType_t number;
+    configRUN_TIME_COUNTER_TYPE run_time;
+} stats_last[STATS_MAX_TASKS];
+static UBaseType_t stats_last_count = 0;
+static uint64_t stats_last_time = 0;
+
+static BaseType_t prvStatsCommand(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+    configRUN_TIME_COUNTER_TYPE total;
+    UBaseType_t count = uxTaskGetSystemState(stats_tasks, STATS_MAX_TASKS, &total);
+    uint64_t now = time_us_64();
+    uint64_t elapsed = now - stats_last_time;
+    size_t len = snprintf(pcWriteBuffer, xWriteBufferLen, "%% of one core over the last %u ms:\r\n", (unsigned) (elapsed / 1000));
+    for(UBaseType_t i = 0; i < count && len < xWriteBufferLen; i++) {
+        configRUN_TIME_COUNTER_TYPE before = 0;
+        for(UBaseType_t j = 0; j < stats_last_count; j++) {
+            if(stats_last[j].number == stats_tasks[i].xTaskNumber) before = stats_last[j].run_time;
+        }
+        uint64_t used = stats_tasks[i].ulRunTimeCounter - before;
+        unsigned permille = elapsed ? (unsigned) (used * 1000 / elapsed) : 0;
+        len += snprintf(pcWriteBuffer + len, xWriteBufferLen - len, "%-16s %3u.%u%%\r\n", stats_tasks[i].pcTaskName, permille / 10, permille % 10);
+    }
+    for(UBaseType_t i = 0; i < count; i++) {
+        stats_last[i].number = stats_tasks[i].xTaskNumber;
+        stats_last[i].run_time = stats_tasks[i].ulRunTimeCounter;
+    }
+    stats_last_count = count;
+    stats_last_time = now;
+    return pdFALSE;
+}
+
+static const CLI_Command_Definition_t xStatsCommand =
+{
+    "stats",
+    "stats: CPU use per task since the last stats\r\n",
+    prvStatsCommand,
+    0
+};
+
 static BaseType_t prvBootromCommand(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
     printf("Entering bootloader mode\n");
     rom_reset_usb_boot(0, 0);
@@ -171,11 +217,15 @@ static const CLI_Command_Definition_t xRelayOnCommand =
 void main_task(__unused void* params) {
     // cli interpreter
     FreeRTOS_CLIRegisterCommand(&xTasksCommand);
+    FreeRTOS_CLIRegisterCommand(&xStatsCommand);
     FreeRTOS_CLIRegisterCommand(&xBootromCommand);
     FreeRTOS_CLIRegisterCommand(&xResetCommand);
     FreeRTOS_CLIRegisterCommand(&xRelayOffCommand);
     FreeRTOS_CLIRegisterCommand(&xRelayOnCommand);
     rev_register_commands();
+    can_register_commands();
+    gs_usb_register_commands();
+    telemetry_register_commands();
     vTaskDelay(2500);
     printf("\n\nOh god this is a serial console\n# ");
     char str[MAX_STRLEN] = {0xFF};
@@ -277,7 +327,12 @@ void run_oled_display(__unused void* params) {
         ssd1306_write_str(buf, 0, 16, (char*) t.c_str());
         t = "Err: " + std::to_string(rev_get_error());
         ssd1306_write_str(buf, 0, 24, (char*) t.c_str());
-        t = "Vel: " + std::to_string(rev_get_velocity());
+        if(mode == 0) {
+            // show where the motion profile has got to while we're moving the setpoint around
+            t = "Ref: " + std::to_string(rev_get_reference());
+        } else {
+            t = "Vel: " + std::to_string(rev_get_velocity());
+        }
         ssd1306_write_str(buf, 0, 32, (char*) t.c_str());
         t = "kP: " + std::to_string(kP);
         ssd1306_write_str(buf, 0, 40, (char*) t.c_str());
@@ -317,9 +372,26 @@ void run_oled_display(__unused void* params) {
     }
 }
 
+static TaskHandle_t tinyusb_task_handle = NULL;
+
+// TinyUSB calls this whenever it queues an event (usually from the USB irq), which is the only time tud_task() has
+// anything to do
+void tud_event_hook_cb(uint8_t rhport, uint32_t eventid, bool in_isr) {
+    if(tinyusb_task_handle == NULL) return;
+    if(in_isr) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(tinyusb_task_handle, &woken);
+        portYIELD_FROM_ISR(woken);
+    } else {
+        xTaskNotifyGive(tinyusb_task_handle);
+    }
+}
+
 void tinyusb_task(__unused void* params) {
+    tinyusb_task_handle = xTaskGetCurrentTaskHandle();
     while(1) {
         tud_task();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
 
@@ -348,6 +420,10 @@ int main()
     gpio_set_dir(16, GPIO_OUT);
     gpio_put(16, 0);
     gpio_set_function(16, GPIO_FUNC_SIO);
+    can_init();
+    gs_usb_init();
+    rev_control_init();
+    rev_param_init();
 
     TaskHandle_t task_handle_main_task = NULL;
     TaskHandle_t task_handle_ws2812 = NULL;
@@ -355,6 +431,7 @@ int main()
     TaskHandle_t task_handle_tinyusb = NULL;
     TaskHandle_t task_handle_gs_usb = NULL;
     TaskHandle_t task_handle_can = NULL;
+    TaskHandle_t task_handle_telemetry = NULL;
     TaskHandle_t task_handle_quadrature = NULL;
     TaskHandle_t rev_fun = NULL;
     xTaskCreate(main_task, "Main Task", 2048, NULL, 1, &task_handle_main_task);
@@ -364,12 +441,14 @@ int main()
     xTaskCreate(tinyusb_task, "TinyUSB", 2048, NULL, 1, &task_handle_tinyusb);
     xTaskCreate(gs_usb_task, "GS USB", 2048, NULL, 1, &task_handle_gs_usb);
     xTaskCreate(can_task, "CAN", 2048, NULL, 1, &task_handle_can);
+    xTaskCreate(telemetry_task, "Telemetry", 1024, NULL, 1, &task_handle_telemetry);
     xTaskCreate(rev_fun_task, "Rev Fun", 2048, NULL, 1, &rev_fun);
     vTaskCoreAffinitySet(task_handle_main_task, 1);
     vTaskCoreAffinitySet(task_handle_tinyusb, 1);
     vTaskCoreAffinitySet(task_handle_gs_usb, 1);
     vTaskCoreAffinitySet(task_handle_ws2812, 1);
     vTaskCoreAffinitySet(task_handle_can, 1);
+    vTaskCoreAffinitySet(task_handle_telemetry, 1);
     vTaskCoreAffinitySet(task_handle_oled_display, 0x01);
     vTaskCoreAffinitySet(task_handle_quadrature, 0x01);
     vTaskCoreAffinitySet(rev_fun, 0x01);
@@ -0,0 +1,54 @@
+#include "pid.h"
+#include <algorithm>
+
+static float pid_clamp(float value, float min, float max) {
+  return std::max(min, std::min(max, value));
+}
+
+pid_gains pid_default_gains(float out_limit) {
+  pid_gains gains = {};
+  gains.i_max = out_limit;
+  gains.out_min = -out_limit;
+  gains.out_max = out_limit;
+  return gains;
+}
+
+void pid_reset(pid_state* state) {
+  *state = {};
+}
+
+float pid_update(const pid_gains* gains, pid_state* state, float setpoint, float measurement, float dt,
+    float ref_velocity, float ref_acceleration) {
+  float error = setpoint - measurement;
+
+  // derivative on measurement rather than error so setpoint steps don't kick the output.
+  // first order low-pass, alpha = dt / (tau + dt) is close enough to 1 - e^(-dt/tau) at our rates
+  if(state->initialized && dt > 0) {
+    float rate = -(measurement - state->last_measurement) / dt;
+    float alpha = gains->d_filter_tau > 0 ? dt / (gains->d_filter_tau + dt) : 1.0f;
+    state->d_filtered += alpha * (rate - state->d_filtered);
+  }
+  state->last_measurement = measurement;
+
+  float ff = gains->kv * ref_velocity + gains->ka * ref_acceleration;
+  if(ref_velocity > 0) ff += gains->ks;
+  if(ref_velocity < 0) ff -= gains->ks;
+
+  float unsaturated = gains->kp * error + state->integral + gains->kd * state->d_filtered + ff;
+  float out = pid_clamp(unsaturated, gains->out_min, gains->out_max);
+  if(gains->slew_rate > 0 && state->initialized) {
+    float step = gains->slew_rate * dt;
+    out = pid_clamp(out, state->last_output - step, state->last_output + step);
+  }
+
+  // anti-windup: stop integrating while the output is pinned in the direction the error is pushing it, bleed off
+  // whatever got through by back-calculation, and never let the term past i_max
+  bool pinned = (out < unsaturated && error > 0) || (out > unsaturated && error < 0);
+  if(!pinned) state->integral += gains->ki * error * dt;
+  state->integral += gains->kaw * (out - unsaturated) * dt;
+  state->integral = pid_clamp(state->integral, -gains->i_max, gains->i_max);
+
+  state->last_output = out;
+  state->initialized = true;
+  return out;
+}
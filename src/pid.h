@@ -0,0 +1,34 @@
+#pragma once
+
+// Plain PID + feed-forward, no pico or FreeRTOS in here so it builds and runs on the host too, see test/pid_test.cpp.
+// Every update is the same handful of float ops whatever the state, no loops or libm calls.
+
+struct pid_gains {
+  float kp;
+  float ki;
+  float kd;
+  // feed-forward, from the reference velocity/acceleration passed to pid_update
+  float ks; // static friction, applied in the direction of the reference velocity
+  float kv;
+  float ka;
+  float i_max;        // the integral term is clamped to +-i_max (output units)
+  float kaw;          // back-calculation gain, bleeds the integrator by kaw * (saturated - unsaturated) per second
+  float d_filter_tau; // time constant of the low-pass on the derivative, seconds. 0 for no filtering
+  float out_min;
+  float out_max;
+  float slew_rate;    // max change in output per second, 0 for unlimited
+};
+
+struct pid_state {
+  float integral; // stored as the integral term (already multiplied by ki) so retuning ki doesn't bump the output
+  float d_filtered;
+  float last_measurement;
+  float last_output;
+  bool initialized;
+};
+
+// Sensible starting point: everything off, output limited to +-out_limit, integrator allowed the whole range
+pid_gains pid_default_gains(float out_limit);
+void pid_reset(pid_state* state);
+float pid_update(const pid_gains* gains, pid_state* state, float setpoint, float measurement, float dt,
+  float ref_velocity = 0.0f, float ref_acceleration = 0.0f);
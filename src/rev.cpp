@@ -1,12 +1,21 @@
 #include "rev.h"
 #include "revconsts.h"
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 #include <bit>
 #include <stdio.h>
-#include <map>
+#include "hardware/timer.h"
 #include "FreeRTOS.h"
 #include "FreeRTOS-Plus-CLI/FreeRTOS_CLI.h"
 #include "task.h"
-#include "gs_usb_task.h"
+#include "timers.h"
+#include "pico/sync.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+#include "telemetry.h"
 
 union frc_msg_id {
   uint32_t can_msg_id;
@@ -69,112 +78,274 @@ union rev_data_frame_interpretations {
   } pf7;
 };
 
-struct rev_motor_info {
-  int16_t applied_output;
-  float velocity;
-  float position;
-  float current;
-  float voltage;
-  uint8_t temperature;
-  uint16_t faults;
-  uint16_t sticky_faults;
-  uint8_t follower_data;
-  TickType_t last_pf0;
-  TickType_t last_pf1;
-  TickType_t last_pf2;
-  TickType_t last_pf3;
-  TickType_t last_pf4;
-  TickType_t last_pf5;
-  TickType_t last_pf6;
-  TickType_t last_pf7;
+
+// FRC device numbers are 6 bits, so every possible device gets a slot up front and lookups are just an index.
+// A bit in rev_motor_present gets set the first time we hear a status frame from that device.
+#define REV_MAX_DEVICES 64
+
+/* Each record is a seqlock. The decoder (only ever run from can_task, so there's exactly one writer) bumps seq to
+ * odd before touching the record and back to even when it's done. Readers on any core copy the record out and retry
+ * if seq was odd or changed underneath them, so they always get a consistent snapshot without ever blocking
+ * the writer. The write is a few dozen cycles with irqs masked on can_task's own core (no lock, nothing on the
+ * other core notices), so a higher priority reader on that core (the control task shares core 0 with can_task)
+ * can never preempt it halfway and then spin on it forever. Readers only ever have to spin for that long.
+ */
+struct rev_motor_slot {
+  std::atomic<uint32_t> seq;
+  rev_motor_info info;
 };
 
-static std::map<uint32_t, rev_motor_info> rev_motor_infos{};
+static rev_motor_slot rev_motor_infos[REV_MAX_DEVICES];
+static uint32_t rev_motor_present[REV_MAX_DEVICES / 32];
+
+static bool rev_motor_is_present(int dev_num) {
+  return rev_motor_present[dev_num / 32] & (1u << (dev_num % 32));
+}
+
+// Way more than a write can take, just so a reader can't hang if something's badly wrong
+#define REV_MOTOR_READ_SPINS 1000
+
+static rev_motor_info* rev_motor_write_begin(rev_motor_slot* slot) {
+  slot->seq.store(slot->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return &slot->info;
+}
+
+static void rev_motor_write_end(rev_motor_slot* slot) {
+  slot->seq.store(slot->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
 
-rev_motor_info* get_rev_motor_info(int dev_num) {
-  auto it = rev_motor_infos.find(dev_num);
-  if(it == rev_motor_infos.end()) {
-    return NULL;
+bool rev_get_motor_info(int dev_num, rev_motor_info* out) {
+  if(dev_num < 0 || dev_num >= REV_MAX_DEVICES || !rev_motor_is_present(dev_num)) {
+    return false;
   }
-  return &it->second;
+  rev_motor_slot* slot = &rev_motor_infos[dev_num];
+  for(int tries = 0; tries < REV_MOTOR_READ_SPINS; tries++) {
+    uint32_t before = slot->seq.load(std::memory_order_acquire);
+    if((before & 1) == 0) {
+      *out = slot->info;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(slot->seq.load(std::memory_order_relaxed) == before) return true;
+    }
+    tight_loop_contents();
+  }
+  return false;
 }
 
 bool rev_motor_fell_off(int dev_num) {
-  auto info = get_rev_motor_info(dev_num);
-  if(info == NULL) return true;
-  return abs(xTaskGetTickCount() - info->last_pf0) > pdMS_TO_TICKS(1000);
+  rev_motor_info info;
+  if(!rev_get_motor_info(dev_num, &info)) return true;
+  return time_us_32() - info.last_pf0 > 1000000;
+}
+
+/* Status frame handlers. Each one only ever looks at its own interpretation of the payload, and gets called with the
+ * seqlock already held.
+ */
+typedef void (*rev_frame_handler)(rev_motor_info* info, const struct can_msg* frame);
+
+static const rev_data_frame_interpretations* rev_frame_data(const struct can_msg* frame) {
+  return (const rev_data_frame_interpretations*) frame->data;
+}
+
+// so this has different meaning depending on who's sending it but we have no way of knowing that :)
+static void rev_handle_status_0(rev_motor_info* info, const struct can_msg* frame) {
+  auto pf0 = rev_frame_data(frame)->pf0;
+  // printf("Received periodic status 0 frame with applied output %d, faults %d, sticky faults %d, is follower %d\n", pf0.applied_output, pf0.faults, pf0.sticky_faults, pf0.is_follower);
+  info->applied_output = pf0.applied_output;
+  info->faults = pf0.faults;
+  info->sticky_faults = pf0.sticky_faults;
+  info->follower_data = pf0.is_follower;
+  info->last_pf0 = frame->timestamp_us;
+}
+
+static void rev_handle_status_1(rev_motor_info* info, const struct can_msg* frame) {
+  auto pf1 = rev_frame_data(frame)->pf1;
+  // printf("Received periodic status 1 frame with velocity %f, temperature %d, voltage %d, current %d\n", pf1.velocity, pf1.temperature, pf1.voltage, pf1.current);
+  info->velocity = pf1.velocity;
+  info->temperature = pf1.temperature;
+  info->voltage = pf1.voltage / 128.0;
+  info->current = pf1.current / 128.0;
+  info->last_pf1 = frame->timestamp_us;
+}
+
+static void rev_handle_status_2(rev_motor_info* info, const struct can_msg* frame) {
+  // printf("Received periodic status 2 frame with position %f\n", rev_frame_data(frame)->pf2.position);
+  info->position = rev_frame_data(frame)->pf2.position;
+  info->last_pf2 = frame->timestamp_us;
+}
+
+static void rev_handle_status_3(rev_motor_info* info, const struct can_msg* frame) {
+  auto pf3 = rev_frame_data(frame)->pf3;
+  // printf("Received periodic status 3 frame with analog sensor voltage %d, analog sensor velocity %d, analog sensor position %f\n", pf3.analog_sensor_voltage, pf3.analog_sensor_velocity, pf3.analog_sensor_position);
+  info->analog_voltage_raw = pf3.analog_sensor_voltage;
+  // velocity is a signed 22 bit field, shift it up to the top of the word and back down to sign extend
+  info->analog_velocity_raw = (int32_t) ((uint32_t) pf3.analog_sensor_velocity << 10) >> 10;
+  info->analog_position = pf3.analog_sensor_position;
+  info->last_pf3 = frame->timestamp_us;
+}
+
+static void rev_handle_status_4(rev_motor_info* info, const struct can_msg* frame) {
+  auto pf4 = rev_frame_data(frame)->pf4;
+  // printf("Received periodic status 4 frame with alternate encoder velocity %f, alternate encoder position %f\n", pf4.alternate_encoder_velocity, pf4.alternate_encoder_position);
+  info->alt_encoder_velocity = pf4.alternate_encoder_velocity;
+  info->alt_encoder_position = pf4.alternate_encoder_position;
+  info->last_pf4 = frame->timestamp_us;
+}
+
+static void rev_handle_status_5(rev_motor_info* info, const struct can_msg* frame) {
+  auto pf5 = rev_frame_data(frame)->pf5;
+  // printf("Received periodic status 5 frame with duty cycle position %f, duty cycle absolute angle %d\n", pf5.duty_cycle_position, pf5.duty_cycle_absolute_angle);
+  info->duty_cycle_position = pf5.duty_cycle_position;
+  info->duty_cycle_absolute_angle = pf5.duty_cycle_absolute_angle;
+  info->last_pf5 = frame->timestamp_us;
+}
+
+static void rev_handle_status_6(rev_motor_info* info, const struct can_msg* frame) {
+  auto pf6 = rev_frame_data(frame)->pf6;
+  // printf("Received periodic status 6 frame with duty cycle velocity %f, duty cycle frequency %d\n", pf6.duty_cycle_velocity, pf6.duty_cycle_frequency);
+  info->duty_cycle_velocity = pf6.duty_cycle_velocity;
+  info->duty_cycle_frequency = pf6.duty_cycle_frequency;
+  info->last_pf6 = frame->timestamp_us;
+}
+
+static void rev_handle_status_7(rev_motor_info* info, const struct can_msg* frame) {
+  memcpy(info->status7_data, rev_frame_data(frame)->pf7.data, sizeof(info->status7_data));
+  info->last_pf7 = frame->timestamp_us;
+}
+
+// One entry per possible 10 bit api (api_class << 4 | api_index), built at compile time. Anything we don't decode is
+// left null, so a lookup is a single load instead of the std::map walk int_to_spark_max_can_api does.
+#define REV_API_COUNT 1024
+
+static constexpr std::array<rev_frame_handler, REV_API_COUNT> rev_frame_handlers = [] {
+  std::array<rev_frame_handler, REV_API_COUNT> table{};
+  table[PERIODIC_STATUS_0] = rev_handle_status_0;
+  table[PERIODIC_STATUS_1] = rev_handle_status_1;
+  table[PERIODIC_STATUS_2] = rev_handle_status_2;
+  table[PERIODIC_STATUS_3] = rev_handle_status_3;
+  table[PERIODIC_STATUS_4] = rev_handle_status_4;
+  table[PERIODIC_STATUS_5] = rev_handle_status_5;
+  table[PERIODIC_STATUS_6] = rev_handle_status_6;
+  table[PERIODIC_STATUS_7] = rev_handle_status_7;
+  return table;
+}();
+
+static_assert(rev_frame_handlers[PERIODIC_STATUS_0] == rev_handle_status_0, "status 0 should be in the dispatch table");
+static_assert(rev_frame_handlers[HEARTBEAT] == nullptr, "we shouldn't be decoding our own heartbeats");
+
+// Cheap enough to do before anything else, and most of what's on a real robot bus (pdh, pneumatics, other vendors)
+// fails it on the first compare
+static bool rev_is_motor_controller(frc_msg_id id) {
+  return id.manufacturer_code == FRC_MANUFACTURER_REV_ROBOTICS && id.device_type == MOTOR_CONTROLLER;
+}
+
+/* Arrival statistics for every (device, status frame) pair, so status periods can be tuned down without guessing.
+ * Only updated from can_task. mean and jitter are exponential moving averages (1/16 weight) so they follow changes to
+ * the configured period, min/max/missed accumulate until someone runs "revstats reset".
+ * A long gap is only counted as missed frames once a normal length gap follows it. A run of REV_STATS_RESEED long gaps
+ * in a row means the period went up rather than frames going missing, so the mean gets re-seeded from the new gap and
+ * the run is forgotten.
+ */
+#define REV_STATUS_FRAMES 8
+#define REV_STATS_EWMA_WEIGHT (1.0f / 16)
+#define REV_STATS_WARMUP 8 // frames before we trust the mean enough to call gaps missed frames
+#define REV_STATS_RESEED 4
+
+struct rev_frame_stats {
+  uint32_t last_us;
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  float mean_us;
+  float jitter_us; // mean absolute deviation from mean_us
+  uint32_t missed;
+  uint32_t pending_missed; // from the current run of long gaps, not counted until we know the period didn't change
+  uint8_t long_gaps;
+};
+
+static rev_frame_stats rev_status_stats[REV_MAX_DEVICES][REV_STATUS_FRAMES];
+static volatile bool rev_stats_reset_requested = false;
+
+static void rev_update_frame_stats(rev_frame_stats* stats, uint32_t now_us) {
+  if(stats->count++ == 0) {
+    stats->last_us = now_us;
+    return;
+  }
+  uint32_t dt = now_us - stats->last_us;
+  stats->last_us = now_us;
+  if(stats->count == 2) {
+    stats->min_us = stats->max_us = dt;
+    stats->mean_us = dt;
+    return;
+  }
+  if(dt < stats->min_us) stats->min_us = dt;
+  if(dt > stats->max_us) stats->max_us = dt;
+  if(stats->count > REV_STATS_WARMUP && dt > stats->mean_us * 1.5f) {
+    if(++stats->long_gaps < REV_STATS_RESEED) {
+      // a gap of ~n periods means n - 1 frames went missing. don't let the gap drag the mean around either
+      stats->pending_missed += (uint32_t) (dt / stats->mean_us + 0.5f) - 1;
+      return;
+    }
+    // the period's been raised, start again from the new one
+    stats->mean_us = dt;
+    stats->jitter_us = 0;
+    stats->pending_missed = 0;
+    stats->long_gaps = 0;
+    return;
+  }
+  stats->missed += stats->pending_missed;
+  stats->pending_missed = 0;
+  stats->long_gaps = 0;
+  float dev = dt - stats->mean_us;
+  stats->mean_us += dev * REV_STATS_EWMA_WEIGHT;
+  stats->jitter_us += (fabsf(dev) - stats->jitter_us) * REV_STATS_EWMA_WEIGHT;
 }
 
+// Which status frame (if any) should kick the control task for each device, for controllers in data driven mode.
+// Written by the controller config functions, read here in can_task.
+static volatile uint8_t rev_control_trigger_api[REV_MAX_DEVICES];
+static void rev_control_data_ready(int dev_num);
+static void rev_param_response(int dev_num, int param_id, const can_msg* frame);
+
 void rev_can_frame_callback(struct can_msg* frame) {
   frc_msg_id id;
   id.can_msg_id = frame->id;
-  // 5 0 6 5 2
-  // 5 1 6 5 2
-  const char* manu_name = frc_manufacturer_names[id.manufacturer_code];
-  const char* device_name = frc_device_type_names[id.device_type];
   // printf("Received frame with id: %d %d %d %d %d\n", id.device_number, id.api_index, id.api_class, id.manufacturer_code, id.device_type);
-  // printf("Received frame to/from %s's %s #%d. id %02x cl %02x API %s\n", manu_name, device_name, id.device_number, id.api_index, id.api_class, get_spark_max_can_api_name(int_to_spark_max_can_api(id.api, nullptr)));
-  enum SPARK_MAX_CAN_API api = int_to_spark_max_can_api(id.api, nullptr);
-  rev_data_frame_interpretations* data = (rev_data_frame_interpretations*)frame->data;
-  auto pf0 = data->pf0;
-  auto pf1 = data->pf1;
-  auto pf2 = data->pf2;
-  auto pf3 = data->pf3;
-  auto pf4 = data->pf4;
-  auto pf5 = data->pf5;
-  auto pf6 = data->pf6;
-  auto pf7 = data->pf7;
-  switch(api) {
-    case PERIODIC_STATUS_0: // so this has different meaning depending on who's sending it but we have no way of knowing that :)
-      // if(pf0.applied_output == 0) break;
-      // printf("Received periodic status 0 frame with applied output %d, faults %d, sticky faults %d, is follower %d\n", pf0.applied_output, pf0.faults, pf0.sticky_faults, pf0.is_follower);
-      rev_motor_infos[id.device_number].applied_output = pf0.applied_output;
-      rev_motor_infos[id.device_number].faults = pf0.faults;
-      rev_motor_infos[id.device_number].sticky_faults = pf0.sticky_faults;
-      rev_motor_infos[id.device_number].follower_data = pf0.is_follower;
-      rev_motor_infos[id.device_number].last_pf0 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_1:
-      // if(pf1.velocity == 0) break;
-      // printf("Received periodic status 1 frame with velocity %f, temperature %d, voltage %d, current %d\n", pf1.velocity, pf1.temperature, pf1.voltage, pf1.current);
-      rev_motor_infos[id.device_number].velocity = pf1.velocity;
-      rev_motor_infos[id.device_number].temperature = pf1.temperature;
-      rev_motor_infos[id.device_number].voltage = pf1.voltage / 128.0;
-      rev_motor_infos[id.device_number].current = pf1.current / 128.0;
-      rev_motor_infos[id.device_number].last_pf1 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_2:
-      // printf("Received periodic status 2 frame with position %f\n", pf2.position);
-      rev_motor_infos[id.device_number].position = pf2.position;
-      rev_motor_infos[id.device_number].last_pf2 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_3:
-      // printf("Received periodic status 3 frame with analog sensor voltage %d, analog sensor velocity %d, analog sensor position %f\n", pf3.analog_sensor_voltage, pf3.analog_sensor_velocity, pf3.analog_sensor_position);
-      rev_motor_infos[id.device_number].last_pf3 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_4:
-      // printf("Received periodic status 4 frame with alternate encoder velocity %f, alternate encoder position %f\n", pf4.alternate_encoder_velocity, pf4.alternate_encoder_position);
-      rev_motor_infos[id.device_number].last_pf4 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_5:
-      // printf("Received periodic status 5 frame with duty cycle position %f, duty cycle absolute angle %d\n", pf5.duty_cycle_position, pf5.duty_cycle_absolute_angle);
-      rev_motor_infos[id.device_number].last_pf5 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_6:
-      // printf("Received periodic status 6 frame with duty cycle velocity %f, duty cycle frequency %d\n", pf6.duty_cycle_velocity, pf6.duty_cycle_frequency);
-      rev_motor_infos[id.device_number].last_pf6 = xTaskGetTickCount();
-      break;
-    case PERIODIC_STATUS_7:
-      // printf("Received periodic status 7 frame with data %02x %02x %02x %02x %02x %02x %02x %02x\n", data->pf7.data[0], data->pf7.data[1], data->pf7.data[2], data->pf7.data[3], data->pf7.data[4], data->pf7.data[5], data->pf7.data[6], data->pf7.data[7]);
-      rev_motor_infos[id.device_number].last_pf7 = xTaskGetTickCount();
-      break;
-    default:
-      // printf("Received frame to/from %s %s #%d. cl %02x id %02x API %s\n", manu_name, device_name, id.device_number, id.api_class, id.api_index, get_spark_max_can_api_name(api));
-      break;
-  };
+  if(!rev_is_motor_controller(id)) return;
+  if(id.api >= PARAMETER_ACCESS) {
+    rev_param_response(id.device_number, id.api - PARAMETER_ACCESS, frame);
+    return;
+  }
+  rev_frame_handler handler = rev_frame_handlers[id.api];
+  if(handler == nullptr) {
+    // printf("Received frame to/from spark #%d. cl %02x id %02x API %s\n", id.device_number, id.api_class, id.api_index, get_spark_max_can_api_name(int_to_spark_max_can_api(id.api, nullptr)));
+    return;
+  }
+  rev_motor_slot* slot = &rev_motor_infos[id.device_number];
+  uint32_t irqs = save_and_disable_interrupts();
+  handler(rev_motor_write_begin(slot), frame);
+  rev_motor_write_end(slot);
+  restore_interrupts(irqs);
+  rev_motor_present[id.device_number / 32] |= 1u << (id.device_number % 32);
+  uint8_t trigger = rev_control_trigger_api[id.device_number];
+  if(trigger != 0 && trigger == id.api) rev_control_data_ready(id.device_number);
+
+  if(rev_stats_reset_requested) {
+    memset(rev_status_stats, 0, sizeof(rev_status_stats));
+    rev_stats_reset_requested = false;
+  }
+  if(id.api >= PERIODIC_STATUS_0 && id.api <= PERIODIC_STATUS_7) {
+    rev_update_frame_stats(&rev_status_stats[id.device_number][id.api - PERIODIC_STATUS_0], frame->timestamp_us);
+  }
+}
+
+void rev_can_frames_callback(struct can_msg* frames, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    rev_can_frame_callback(&frames[i]);
+  }
 }
 
-static bool heartbeat_enabled = false;
+static volatile bool heartbeat_enabled = false;
 
 static BaseType_t enable_heartbeat(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
   printf("Enabling heartbeat\n");
@@ -202,144 +373,1279 @@ const CLI_Command_Definition_t xRevCommand2 = {
   0
 };
 
-void rev_register_commands() {
-  FreeRTOS_CLIRegisterCommand(&xRevCommand);
-  FreeRTOS_CLIRegisterCommand(&xRevCommand2);
+static BaseType_t motor_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  BaseType_t param_len;
+  const char* param = FreeRTOS_CLIGetParameter(pcCommandString, 1, &param_len);
+  int dev_num = atoi(param);
+  rev_motor_info info;
+  if(!rev_get_motor_info(dev_num, &info)) {
+    snprintf(pcWriteBuffer, xWriteBufferLen, "Never heard from motor %d\r\n", dev_num);
+    return pdFALSE;
+  }
+  snprintf(pcWriteBuffer, xWriteBufferLen,
+    "Motor %d: Applied output: %d, Velocity: %f, Position: %f, Current: %f, Voltage: %f, Temperature: %d, Faults: %d, Sticky faults: %d, Follower data: %d, last status 0 %u us ago\r\n",
+    dev_num, info.applied_output, info.velocity, info.position, info.current, info.voltage, info.temperature,
+    info.faults, info.sticky_faults, info.follower_data, time_us_32() - info.last_pf0);
+  size_t len = strlen(pcWriteBuffer);
+  snprintf(pcWriteBuffer + len, xWriteBufferLen - len,
+    "  Analog: %u raw, vel %d, pos %f. Alt encoder: vel %f, pos %f. Absolute: pos %f, angle %u, vel %f, freq %u\r\n",
+    info.analog_voltage_raw, (int) info.analog_velocity_raw, info.analog_position, info.alt_encoder_velocity,
+    info.alt_encoder_position, info.duty_cycle_position, info.duty_cycle_absolute_angle, info.duty_cycle_velocity,
+    info.duty_cycle_frequency);
+  return pdFALSE;
 }
 
-void rev_send_heartbeat(int dev_num) {
+static const CLI_Command_Definition_t xMotorCommand = {
+  "motor",
+  "motor <n>: Show the latest status of REV motor controller n\r\n",
+  motor_command,
+  1
+};
+
+static BaseType_t rev_bench_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  const uint32_t n = 1000;
+  // a CTRE talon status frame, which is the sort of thing that makes up most of a busy bus
+  struct can_msg foreign = { .id = 0x02041400, .dlc = 8 };
+  struct can_msg status = { .dlc = 8 };
   frc_msg_id id;
-  id.api = NON_RIO_HEARTBEAT;
-  id.device_number = dev_num;
+  id.can_msg_id = 0;
+  id.api = PERIODIC_STATUS_2;
   id.device_type = MOTOR_CONTROLLER;
   id.manufacturer_code = FRC_MANUFACTURER_REV_ROBOTICS;
-  can_msg msg = { 0 };
-  msg.id = id.can_msg_id;
-  msg.dlc = 8;
-  msg.data32[0] = 0xFFFFFFFF;
-  msg.data32[1] = 0xFFFFFFFF;
-  can_send_msg(&msg);
-  gs_usb_send_can_frame(&msg);
+  status.id = id.can_msg_id;
+  volatile uint32_t sink = 0;
+
+  uint64_t start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    rev_can_frame_callback(&foreign);
+  }
+  uint64_t rejected = time_us_64() - start;
+
+  start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    sink = sink + (rev_frame_handlers[id.api] != nullptr);
+  }
+  uint64_t table_lookup = time_us_64() - start;
+
+  start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    sink = sink + int_to_spark_max_can_api(id.api, nullptr);
+  }
+  uint64_t map_lookup = time_us_64() - start;
+
+  // decode into a scratch record rather than a real device's slot
+  rev_motor_info scratch;
+  start = time_us_64();
+  for(uint32_t i = 0; i < n; i++) {
+    rev_frame_handlers[id.api](&scratch, &status);
+  }
+  uint64_t decode = time_us_64() - start;
+
+  snprintf(pcWriteBuffer, xWriteBufferLen,
+    "ns per frame over %u runs:\r\n"
+    "non-REV frame rejected: %u\r\n"
+    "dispatch table lookup: %u\r\n"
+    "int_to_spark_max_can_api lookup: %u\r\n"
+    "status 2 decode: %u\r\n",
+    n, (uint32_t) (rejected * 1000 / n), (uint32_t) (table_lookup * 1000 / n),
+    (uint32_t) (map_lookup * 1000 / n), (uint32_t) (decode * 1000 / n));
+  return pdFALSE;
 }
 
-void rev_send_duty_cycle(int dev_num, float speed) {
+// CLI parameters aren't NUL terminated, so a plain strncmp against the token length would take any prefix of name
+static bool rev_token_is(const char* token, BaseType_t len, const char* name) {
+  return token != nullptr && strlen(name) == (size_t) len && strncmp(token, name, len) == 0;
+}
+
+// One device per call so a full bus doesn't overflow the output buffer
+static BaseType_t rev_stats_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  static int next_dev = 0;
+  BaseType_t param_len;
+  const char* param = FreeRTOS_CLIGetParameter(pcCommandString, 1, &param_len);
+  if(rev_token_is(param, param_len, "reset")) {
+    rev_stats_reset_requested = true;
+    snprintf(pcWriteBuffer, xWriteBufferLen, "Status frame stats will reset on the next frame\r\n");
+    return pdFALSE;
+  }
+
+  while(next_dev < REV_MAX_DEVICES && !rev_motor_is_present(next_dev)) next_dev++;
+  if(next_dev == REV_MAX_DEVICES) {
+    next_dev = 0;
+    snprintf(pcWriteBuffer, xWriteBufferLen, "\r\n");
+    return pdFALSE;
+  }
+
+  // not snapshotted, can_task may be mid update but it's only stats
+  size_t len = snprintf(pcWriteBuffer, xWriteBufferLen, "Motor %d:\r\n", next_dev);
+  for(int i = 0; i < REV_STATUS_FRAMES && len < xWriteBufferLen; i++) {
+    rev_frame_stats stats = rev_status_stats[next_dev][i];
+    if(stats.count < 2) continue;
+    len += snprintf(pcWriteBuffer + len, xWriteBufferLen - len,
+      "  status %d: %u frames, period mean %.0f min %u max %u us, jitter %.0f us, missed %u\r\n",
+      i, stats.count, stats.mean_us, stats.min_us, stats.max_us, stats.jitter_us, stats.missed);
+  }
+  next_dev++;
+  return pdTRUE;
+}
+
+static const CLI_Command_Definition_t xRevStatsCommand = {
+  "revstats",
+  "revstats [reset]: Show status frame period/jitter/missed frames for every motor we've heard from\r\n",
+  rev_stats_command,
+  -1
+};
+
+static const CLI_Command_Definition_t xRevBenchCommand = {
+  "revbench",
+  "revbench: Time the REV frame decoder\r\n",
+  rev_bench_command,
+  0
+};
+
+static void rev_make_msg(can_msg* msg, int dev_num, int api, uint32_t dlc) {
   frc_msg_id id;
-  id.api = DUTY_CYCLE_SET;
+  id.can_msg_id = 0;
+  id.api = api;
   id.device_number = dev_num;
   id.device_type = MOTOR_CONTROLLER;
   id.manufacturer_code = FRC_MANUFACTURER_REV_ROBOTICS;
-  can_msg msg = { 0 };
-  msg.id = id.can_msg_id;
-  msg.dlc = 8;
-  msg.data32[0] = *(uint32_t*) &speed;
-  msg.data32[1] = 0;
-  can_send_msg(&msg);
-  gs_usb_send_can_frame(&msg);
+  *msg = { 0 };
+  msg->id = id.can_msg_id;
+  msg->dlc = dlc;
 }
 
+// Keeps the SPARKs enabled when there's no roboRIO on the bus. The payload is a bitmask of enabled devices, we just
+// enable everything
+static void rev_make_heartbeat_msg(can_msg* msg, int dev_num) {
+  rev_make_msg(msg, dev_num, NON_RIO_HEARTBEAT, 8);
+  msg->data32[0] = 0xFFFFFFFF;
+  msg->data32[1] = 0xFFFFFFFF;
+}
 
-TickType_t lastHeartbeatTime = 0;
-TickType_t lastPrintTime = 0;
+static void rev_make_duty_cycle_msg(can_msg* msg, int dev_num, float speed) {
+  rev_make_msg(msg, dev_num, DUTY_CYCLE_SET, 8);
+  memcpy(&msg->data32[0], &speed, sizeof(speed));
+}
+
+// Closed loop setpoint for the SPARK's own pid: float setpoint, int16 arbitrary feed-forward in 1/1024 V,
+// then the pid slot
+static void rev_make_setpoint_msg(can_msg* msg, int dev_num, int api, float setpoint, float arb_ff_volts, int slot) {
+  rev_make_msg(msg, dev_num, api, 8);
+  memcpy(&msg->data32[0], &setpoint, sizeof(setpoint));
+  int16_t arb_ff = std::max(-32768.0f, std::min(32767.0f, arb_ff_volts * 1024.0f));
+  memcpy(&msg->data[4], &arb_ff, sizeof(arb_ff));
+  msg->data[6] = slot & 0x3;
+}
 
+// Parameter writes are the value (little endian, whatever type) followed by the type byte
+static void rev_make_parameter_msg(can_msg* msg, int dev_num, int param_id, uint32_t raw_value, SPARK_MAX_PARAMETER_TYPE type) {
+  rev_make_msg(msg, dev_num, PARAMETER_ACCESS + param_id, 5);
+  msg->data32[0] = raw_value;
+  msg->data[4] = type;
+}
+
+/*
+ * Parameter engine. Each request sits in a fixed table until the SPARK answers on the same PARAMETER_ACCESS id. Up to
+ * REV_PARAM_MAX_INFLIGHT of them are out on the bus at once, across however many devices, so configuring a whole
+ * mechanism costs a few bus round trips instead of one per parameter. A reply can only be matched on (device, param)
+ * so only one request for each pair is in flight at a time, the rest wait their turn. A timer resends anything that
+ * hasn't been answered and gives up after REV_PARAM_TRIES.
+ */
+#define REV_PARAM_MAX_REQUESTS 128
+#define REV_PARAM_MAX_INFLIGHT 16
+#define REV_PARAM_TIMEOUT_US 20000
+#define REV_PARAM_TRIES 3
+#define REV_PARAM_SERVICE_MS 5
+
+struct rev_param_slot {
+  rev_param_request* req;
+  rev_param_batch* batch;
+  uint32_t sent_us;
+  uint8_t tries;
+  bool used;
+  bool sent;
+};
+
+struct rev_param_stats {
+  uint32_t requests;
+  uint32_t retries;
+  uint32_t timeouts;
+  uint32_t errors;
+  uint32_t max_inflight;
+};
+
+// Everything below is guarded by rev_param_lock. Submitters, can_task (replies) and the timer task all get in here
+static critical_section_t rev_param_lock;
+static rev_param_slot rev_param_slots[REV_PARAM_MAX_REQUESTS];
+static uint32_t rev_param_inflight_mask[REV_MAX_DEVICES][SPARK_MAX_PARAMETER_COUNT / 32];
+static volatile uint32_t rev_param_used;
+static rev_param_stats rev_param_counts;
+static TimerHandle_t rev_param_timer;
+
+static bool rev_param_is_inflight(int dev_num, int param_id) {
+  return rev_param_inflight_mask[dev_num][param_id / 32] & (1u << (param_id % 32));
+}
+
+static void rev_param_set_inflight(int dev_num, int param_id, bool inflight) {
+  uint32_t bit = 1u << (param_id % 32);
+  if(inflight) rev_param_inflight_mask[dev_num][param_id / 32] |= bit;
+  else rev_param_inflight_mask[dev_num][param_id / 32] &= ~bit;
+}
+
+// Reads are an empty frame on the parameter's id, writes carry the value and type
+static void rev_make_param_request_msg(can_msg* msg, const rev_param_request* req) {
+  if(req->write) {
+    rev_make_parameter_msg(msg, req->dev_num, req->param_id, req->value.u, (SPARK_MAX_PARAMETER_TYPE) req->type);
+  } else {
+    rev_make_msg(msg, req->dev_num, PARAMETER_ACCESS + req->param_id, 0);
+  }
+}
+
+// Must be called with rev_param_lock held. Returns the task to wake if that was the last request in its batch
+static TaskHandle_t rev_param_complete(rev_param_slot* slot, rev_param_status status) {
+  rev_param_batch* batch = slot->batch;
+  TaskHandle_t notify = batch->notify; // the batch can go away as soon as remaining hits 0
+  if(slot->sent) rev_param_set_inflight(slot->req->dev_num, slot->req->param_id, false);
+  slot->req->status = status;
+  slot->used = false;
+  rev_param_used--;
+  return --batch->remaining == 0 ? notify : nullptr;
+}
+
+// Times out/resends what's on the bus and tops the pipeline back up. Called from the timer, after every reply and on
+// submit
+static void rev_param_service() {
+  if(rev_param_used == 0) return;
+  can_msg msgs[REV_PARAM_MAX_INFLIGHT];
+  size_t n_msgs = 0;
+  TaskHandle_t wake[REV_PARAM_MAX_INFLIGHT];
+  size_t n_wake = 0;
+  uint32_t inflight = 0;
+  uint32_t now = time_us_32();
+
+  critical_section_enter_blocking(&rev_param_lock);
+  for(rev_param_slot& slot : rev_param_slots) {
+    if(!slot.used || !slot.sent) continue;
+    if(now - slot.sent_us < REV_PARAM_TIMEOUT_US) {
+      inflight++;
+    } else if(slot.tries >= REV_PARAM_TRIES) {
+      rev_param_counts.timeouts++;
+      TaskHandle_t notify = rev_param_complete(&slot, REV_PARAM_TIMEOUT);
+      if(notify != nullptr) wake[n_wake++] = notify;
+    } else {
+      // stays marked in flight so a late reply to the last try still counts
+      rev_make_param_request_msg(&msgs[n_msgs++], slot.req);
+      slot.sent_us = now;
+      slot.tries++;
+      rev_param_counts.retries++;
+      inflight++;
+    }
+  }
+  // roughly submit order, slots are handed out from the front of the table
+  for(rev_param_slot& slot : rev_param_slots) {
+    if(inflight >= REV_PARAM_MAX_INFLIGHT) break;
+    if(!slot.used || slot.sent || rev_param_is_inflight(slot.req->dev_num, slot.req->param_id)) continue;
+    rev_make_param_request_msg(&msgs[n_msgs++], slot.req);
+    rev_param_set_inflight(slot.req->dev_num, slot.req->param_id, true);
+    slot.sent = true;
+    slot.sent_us = now;
+    slot.tries = 1;
+    inflight++;
+  }
+  if(inflight > rev_param_counts.max_inflight) rev_param_counts.max_inflight = inflight;
+  critical_section_exit(&rev_param_lock);
+
+  // if the tx queue is full the leftovers just time out and go again
+  if(n_msgs > 0) can_send_msgs(msgs, n_msgs);
+  for(size_t i = 0; i < n_wake; i++) {
+    xTaskNotifyGiveIndexed(wake[i], REV_PARAM_NOTIFY_INDEX);
+  }
+}
+
+// From can_task
+static void rev_param_response(int dev_num, int param_id, const can_msg* frame) {
+  // our own requests come back through tx done on the same id, only the replies are full length
+  if(frame->dlc < 6) return;
+  TaskHandle_t notify = nullptr;
+  critical_section_enter_blocking(&rev_param_lock);
+  if(rev_param_is_inflight(dev_num, param_id)) {
+    for(rev_param_slot& slot : rev_param_slots) {
+      if(!slot.used || !slot.sent || slot.req->dev_num != dev_num || slot.req->param_id != param_id) continue;
+      // value, type, then the response code (0 is ok)
+      slot.req->value.u = frame->data32[0];
+      slot.req->type = frame->data[4];
+      slot.req->response_code = frame->data[5];
+      if(frame->data[5] != 0) rev_param_counts.errors++;
+      notify = rev_param_complete(&slot, frame->data[5] == 0 ? REV_PARAM_OK : REV_PARAM_ERROR);
+      break;
+    }
+  }
+  critical_section_exit(&rev_param_lock);
+  if(notify != nullptr) xTaskNotifyGiveIndexed(notify, REV_PARAM_NOTIFY_INDEX);
+  // a spot on the bus just opened up, don't wait for the timer to fill it
+  rev_param_service();
+}
+
+static void rev_param_timer_callback(TimerHandle_t timer) {
+  rev_param_service();
+}
+
+void rev_param_init() {
+  critical_section_init(&rev_param_lock);
+  // cheap enough to leave running, it returns straight away with nothing queued
+  rev_param_timer = xTimerCreate("REV params", pdMS_TO_TICKS(REV_PARAM_SERVICE_MS), pdTRUE, nullptr, rev_param_timer_callback);
+  xTimerStart(rev_param_timer, 0);
+}
+
+bool rev_param_submit(rev_param_batch* batch) {
+  for(size_t i = 0; i < batch->count; i++) {
+    rev_param_request* req = &batch->requests[i];
+    if(req->dev_num < 0 || req->dev_num >= REV_MAX_DEVICES) return false;
+    if(req->param_id < 0 || req->param_id >= SPARK_MAX_PARAMETER_COUNT) return false;
+    if(req->write && req->type > PARAM_TYPE_BOOL) return false;
+    req->status = REV_PARAM_PENDING;
+    req->response_code = 0;
+  }
+  batch->remaining = batch->count;
+  if(batch->count == 0) return true;
+
+  critical_section_enter_blocking(&rev_param_lock);
+  if(REV_PARAM_MAX_REQUESTS - rev_param_used < batch->count) {
+    critical_section_exit(&rev_param_lock);
+    return false;
+  }
+  size_t next = 0;
+  for(rev_param_slot& slot : rev_param_slots) {
+    if(next == batch->count) break;
+    if(slot.used) continue;
+    slot = {};
+    slot.req = &batch->requests[next++];
+    slot.batch = batch;
+    slot.used = true;
+  }
+  rev_param_used += batch->count;
+  rev_param_counts.requests += batch->count;
+  critical_section_exit(&rev_param_lock);
+
+  // get the first window out now rather than on the next tick
+  rev_param_service();
+  return true;
+}
+
+bool rev_param_transfer(rev_param_request* requests, size_t count) {
+  rev_param_batch batch = {requests, count, 0, xTaskGetCurrentTaskHandle()};
+  if(!rev_param_submit(&batch)) return false;
+  // every request finishes one way or another. The loop is for a completion left over from a batch that had already
+  // been seen as done when its notification arrived
+  while(batch.remaining != 0) {
+    ulTaskNotifyTakeIndexed(REV_PARAM_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+  }
+  for(size_t i = 0; i < count; i++) {
+    if(requests[i].status != REV_PARAM_OK) return false;
+  }
+  return true;
+}
+
+// The SPARK wants a magic number before it'll write its flash
+bool rev_param_burn_flash(int dev_num) {
+  if(dev_num < 0 || dev_num >= REV_MAX_DEVICES) return false;
+  can_msg msg;
+  rev_make_msg(&msg, dev_num, CONFIG_BURN_FLASH, 2);
+  msg.data[0] = 0xA3;
+  msg.data[1] = 0x3A;
+  return can_send_msg(&msg) == 0;
+}
+
+
+#define REV_TELEMETRY_PERIOD_MS 200
+
+// The motor the OLED knob and the rev_get_*/rev_set_* shortcuts talk to
 static unsigned int motor_controller_id = 5;
 
-static float pid_setpoint = 0.0;
-static float pid_kp = 0.0;
-static float pid_ki = 0.0;
-static float pid_kd = 0.0;
-void pid_task(__unused void* params) {
-  unsigned int dt = 20;
-  float i_accum;
-  float last_error;
+/* Controller table. Every active entry gets run by rev_control_task each period and all their setpoint frames go out
+ * as one batch, so adding motors costs a few hundred cycles each instead of another task and stack.
+ * Configs get written from the CLI/OLED tasks and read by rev_control_task, which can preempt them, so they live behind
+ * rev_control_lock and the control task copies them out once per cycle. The integrator etc. are only ever touched by
+ * rev_control_task so they don't need the lock.
+ */
+#define REV_MAX_CONTROLLERS 16
+#define REV_NOMINAL_VOLTAGE 12.0f
+#define REV_CONTROL_PERIOD_US 10000
+#define REV_HEARTBEAT_PERIOD_US 10000
+#define REV_CONTROL_MIN_PERIOD_US 500 // 2 kHz, and even that is more than the bus can carry for a full table
+// the heartbeat rides along with the control cycle, so the loop can't run slower than the heartbeat has to go out
+#define REV_CONTROL_MAX_PERIOD_US REV_HEARTBEAT_PERIOD_US
+
+struct rev_controller_slot {
+  bool used;
+  uint32_t epoch; // bumped when the controller is (re)added or changes mode, tells the control task to reset its state
+  uint32_t gains_epoch; // bumped whenever the gains or limits change, for pushing them to onboard mode controllers
+  rev_controller_config config;
+};
+
+struct rev_controller_state {
+  uint32_t epoch;
+  pid_state pid;
+  uint32_t gains_epoch; // last gains_epoch the SPARK acknowledged, onboard modes only
+  bool profiling;
+  motion_profile profile;
+  volatile float reference; // what the loop is actually chasing this cycle, for display
+  // for telemetry
+  float output;
+  float error;
+  uint32_t last_sample_us; // data driven mode, rx timestamp of the frame we last ran on
+};
+
+static rev_controller_slot rev_controllers[REV_MAX_CONTROLLERS];
+static rev_controller_state rev_controller_states[REV_MAX_CONTROLLERS];
+static critical_section_t rev_control_lock;
+
+// Devices whose controller just went off or got removed. The heartbeat keeps them enabled, so they'd hold their last
+// duty cycle or closed loop setpoint forever. The control task sends each one a zero duty cycle in its next batch.
+static std::atomic<uint32_t> rev_control_stop_pending[REV_MAX_DEVICES / 32];
+
+// Must be called with rev_control_lock held, after anything that changes a controller's mode or removes it
+static void rev_controller_stop_if_off(rev_controller_slot* slot) {
+  if(slot->used && slot->config.mode != REV_CONTROL_OFF) return;
+  int dev_num = slot->config.dev_num;
+  rev_control_stop_pending[dev_num / 32].fetch_or(1u << (dev_num % 32), std::memory_order_relaxed);
+}
+
+// Must be called with rev_control_lock held
+static rev_controller_slot* rev_controller_find(int dev_num) {
+  for(int i = 0; i < REV_MAX_CONTROLLERS; i++) {
+    if(rev_controllers[i].used && rev_controllers[i].config.dev_num == dev_num) return &rev_controllers[i];
+  }
+  return nullptr;
+}
+
+static bool rev_control_mode_is_onboard(rev_control_mode mode) {
+  return mode >= REV_CONTROL_ONBOARD_POSITION;
+}
+
+// A reading of whichever sensor the controller closes the loop on, with the timestamps of the frames it came from
+struct rev_feedback_sample {
+  float position;
+  float velocity;
+  uint32_t position_us;
+  uint32_t velocity_us;
+};
+
+static rev_feedback_source rev_controller_feedback(const rev_controller_config* config) {
+  return rev_control_mode_is_onboard(config->mode) ? REV_FEEDBACK_PRIMARY : config->feedback;
+}
+
+static rev_feedback_sample rev_read_feedback(const rev_controller_config* config, const rev_motor_info* info) {
+  switch(rev_controller_feedback(config)) {
+    case REV_FEEDBACK_ANALOG:
+      return {info->analog_position, (float) info->analog_velocity_raw, info->last_pf3, info->last_pf3};
+    case REV_FEEDBACK_ALT_ENCODER:
+      return {info->alt_encoder_position, info->alt_encoder_velocity, info->last_pf4, info->last_pf4};
+    case REV_FEEDBACK_ABSOLUTE:
+      return {info->duty_cycle_position, info->duty_cycle_velocity, info->last_pf5, info->last_pf6};
+    default:
+      return {info->position, info->velocity, info->last_pf2, info->last_pf1};
+  }
+}
+
+// The status frame that carries the measurement the controller is looking at
+static uint8_t rev_feedback_api(const rev_controller_config* config, bool velocity) {
+  switch(rev_controller_feedback(config)) {
+    case REV_FEEDBACK_ANALOG: return PERIODIC_STATUS_3;
+    case REV_FEEDBACK_ALT_ENCODER: return PERIODIC_STATUS_4;
+    case REV_FEEDBACK_ABSOLUTE: return velocity ? PERIODIC_STATUS_6 : PERIODIC_STATUS_5;
+    default: return velocity ? PERIODIC_STATUS_1 : PERIODIC_STATUS_2;
+  }
+}
+
+// Must be called with rev_control_lock held, after anything that changes a controller's mode/trigger or removes it
+static void rev_controller_update_trigger(rev_controller_slot* slot) {
+  uint8_t api = 0;
+  if(slot->used && slot->config.on_status) {
+    if(slot->config.mode == REV_CONTROL_POSITION) api = rev_feedback_api(&slot->config, false);
+    if(slot->config.mode == REV_CONTROL_VELOCITY) api = rev_feedback_api(&slot->config, true);
+  }
+  rev_control_trigger_api[slot->config.dev_num] = api;
+}
+
+bool rev_controller_add(int dev_num, rev_control_mode mode) {
+  if(dev_num < 0 || dev_num >= REV_MAX_DEVICES) return false;
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(dev_num);
+  for(int i = 0; slot == nullptr && i < REV_MAX_CONTROLLERS; i++) {
+    if(!rev_controllers[i].used) {
+      slot = &rev_controllers[i];
+      slot->config = {};
+      slot->config.dev_num = dev_num;
+      slot->config.pid = pid_default_gains(REV_NOMINAL_VOLTAGE);
+      slot->config.out_min = -1.0f;
+      slot->config.out_max = 1.0f;
+      slot->used = true;
+    }
+  }
+  if(slot != nullptr) {
+    slot->config.mode = mode;
+    slot->epoch++;
+    slot->gains_epoch++;
+    rev_controller_update_trigger(slot);
+    rev_controller_stop_if_off(slot);
+  }
+  critical_section_exit(&rev_control_lock);
+  return slot != nullptr;
+}
+
+void rev_controller_remove(int dev_num) {
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(dev_num);
+  if(slot != nullptr) {
+    slot->used = false;
+    rev_controller_update_trigger(slot);
+    rev_controller_stop_if_off(slot);
+  }
+  critical_section_exit(&rev_control_lock);
+}
+
+bool rev_controller_get(int dev_num, rev_controller_config* out) {
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(dev_num);
+  if(slot != nullptr) *out = slot->config;
+  critical_section_exit(&rev_control_lock);
+  return slot != nullptr;
+}
+
+bool rev_controller_set(const rev_controller_config* config) {
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(config->dev_num);
+  if(slot != nullptr) {
+    // a different sensor reads a different position, so start over rather than jump the integrator and profile
+    if(slot->config.mode != config->mode || slot->config.on_status != config->on_status ||
+        slot->config.feedback != config->feedback) {
+      slot->epoch++;
+    }
+    if(memcmp(&slot->config.pid, &config->pid, sizeof(config->pid)) != 0 || slot->config.out_min != config->out_min ||
+        slot->config.out_max != config->out_max || slot->config.mode != config->mode ||
+        memcmp(&slot->config.profile, &config->profile, sizeof(config->profile)) != 0) {
+      slot->gains_epoch++;
+    }
+    bool mode_changed = slot->config.mode != config->mode;
+    slot->config = *config;
+    rev_controller_update_trigger(slot);
+    if(mode_changed) rev_controller_stop_if_off(slot);
+  }
+  critical_section_exit(&rev_control_lock);
+  return slot != nullptr;
+}
+
+bool rev_controller_set_setpoint(int dev_num, float setpoint) {
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(dev_num);
+  if(slot != nullptr) slot->config.setpoint = setpoint;
+  critical_section_exit(&rev_control_lock);
+  return slot != nullptr;
+}
+
+bool rev_controller_get_reference(int dev_num, float* reference) {
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(dev_num);
+  if(slot != nullptr) *reference = rev_controller_states[slot - rev_controllers].reference;
+  critical_section_exit(&rev_control_lock);
+  return slot != nullptr;
+}
+
+bool rev_controller_set_gains(int dev_num, float kp, float ki, float kd) {
+  critical_section_enter_blocking(&rev_control_lock);
+  rev_controller_slot* slot = rev_controller_find(dev_num);
+  if(slot != nullptr && (slot->config.pid.kp != kp || slot->config.pid.ki != ki || slot->config.pid.kd != kd)) {
+    slot->config.pid.kp = kp;
+    slot->config.pid.ki = ki;
+    slot->config.pid.kd = kd;
+    slot->gains_epoch++;
+  }
+  critical_section_exit(&rev_control_lock);
+  return slot != nullptr;
+}
+
+/* Onboard modes hand the loop to the SPARK itself, which runs it at 1 kHz, and all we do is stream setpoints.
+ * Our gains are volts per unit per second, the SPARK's are duty cycle per unit and don't get scaled by its 1 ms loop
+ * period, so convert on the way out. These go in slot 0.
+ */
+#define REV_ONBOARD_PARAM_COUNT 8
+#define REV_ONBOARD_LOOP_PERIOD 0.001f
+
+static void rev_make_gain_request(rev_param_request* req, int dev_num, int param_id, float value) {
+  *req = {};
+  req->dev_num = dev_num;
+  req->param_id = param_id;
+  req->write = true;
+  req->type = PARAM_TYPE_FLOAT;
+  req->value.f = value;
+}
+
+// Returns how many of requests it filled in
+static size_t rev_make_onboard_gain_requests(rev_param_request* requests, const rev_controller_config* config) {
+  const pid_gains* pid = &config->pid;
+  int dev_num = config->dev_num;
+  rev_make_gain_request(&requests[0], dev_num, PARAM_P_0, pid->kp / REV_NOMINAL_VOLTAGE);
+  rev_make_gain_request(&requests[1], dev_num, PARAM_I_0, pid->ki / REV_NOMINAL_VOLTAGE * REV_ONBOARD_LOOP_PERIOD);
+  rev_make_gain_request(&requests[2], dev_num, PARAM_D_0, pid->kd / REV_NOMINAL_VOLTAGE / REV_ONBOARD_LOOP_PERIOD);
+  // the SPARK multiplies kF by the setpoint whatever the mode, so it's only kV in velocity modes. position gets its
+  // feed-forward from the profile as arbitrary feed-forward instead
+  bool velocity = config->mode == REV_CONTROL_ONBOARD_VELOCITY || config->mode == REV_CONTROL_ONBOARD_SMART_VELOCITY;
+  rev_make_gain_request(&requests[3], dev_num, PARAM_F_0, velocity ? pid->kv / REV_NOMINAL_VOLTAGE : 0.0f);
+  rev_make_gain_request(&requests[4], dev_num, PARAM_OUTPUT_MIN_0, config->out_min);
+  rev_make_gain_request(&requests[5], dev_num, PARAM_OUTPUT_MAX_0, config->out_max);
+  // the smart modes profile on the SPARK, and both limits default to 0 which means it just sits there
+  if(config->mode == REV_CONTROL_ONBOARD_SMART_MOTION) {
+    rev_make_gain_request(&requests[6], dev_num, PARAM_SMART_MOTION_MAX_VELOCITY_0, config->profile.max_velocity * 60);
+    rev_make_gain_request(&requests[7], dev_num, PARAM_SMART_MOTION_MAX_ACCEL_0, config->profile.max_acceleration * 60);
+    return 8;
+  }
+  if(config->mode == REV_CONTROL_ONBOARD_SMART_VELOCITY) {
+    rev_make_gain_request(&requests[6], dev_num, PARAM_SMART_MOTION_MAX_ACCEL_0, config->profile.max_acceleration);
+    return 7;
+  }
+  return 6;
+}
+
+/* Gains go to the SPARK through the parameter engine, so every write gets acknowledged (and retried by the engine if
+ * it isn't). The set only counts as applied once every write came back OK, anything else gets the whole set sent
+ * again after REV_GAIN_RETRY_US. The engine holds on to the batch until it's done, which can outlive the controller
+ * state getting reset, so these live apart from it and only the control task touches them.
+ */
+#define REV_GAIN_RETRY_US 100000
+
+struct rev_gain_push {
+  rev_param_request requests[REV_ONBOARD_PARAM_COUNT];
+  rev_param_batch batch;
+  bool busy;      // batch is with the engine
+  uint32_t epoch; // gains_epoch of the set in the batch
+  uint32_t failed_us; // when the last attempt failed, 0 if it didn't
+};
+
+static rev_gain_push rev_gain_pushes[REV_MAX_CONTROLLERS];
+
+// Returns true once the gains for gains_epoch are on the SPARK
+static bool rev_push_onboard_gains(rev_gain_push* push, const rev_controller_config* config, uint32_t gains_epoch,
+    uint32_t now, uint32_t* failures) {
+  bool applied = false;
+  if(push->busy && push->batch.remaining == 0) {
+    push->busy = false;
+    applied = push->epoch == gains_epoch && push->batch.requests[0].dev_num == config->dev_num;
+    for(size_t i = 0; i < push->batch.count; i++) {
+      if(push->requests[i].status != REV_PARAM_OK) applied = false;
+    }
+    if(applied) return true;
+    if(push->epoch == gains_epoch) {
+      (*failures)++;
+      push->failed_us = now | 1;
+    }
+  }
+  if(push->busy) return false;
+  if(push->failed_us != 0 && now - push->failed_us < REV_GAIN_RETRY_US) return false;
+  push->batch = {push->requests, rev_make_onboard_gain_requests(push->requests, config), 0, nullptr};
+  push->epoch = gains_epoch;
+  push->failed_us = 0;
+  // request table full, just go again next cycle
+  push->busy = rev_param_submit(&push->batch);
+  return false;
+}
+
+/* Position setpoints go through a motion profile when the controller has one, so a big jump in setpoint turns into a
+ * smooth move instead of slamming into the output clamp and winding up the integrator. The profile's velocity and
+ * acceleration then drive the kS/kV/kA feed-forward (in position units per second, not rpm).
+ */
+static motion_profile_point rev_controller_reference(const rev_controller_config* config, rev_controller_state* state,
+    const rev_feedback_sample* feedback, float dt) {
+  motion_profile_point ref = {config->setpoint, 0, 0};
+  if(config->profile.max_velocity <= 0 || config->profile.max_acceleration <= 0) {
+    state->profiling = false;
+    return ref;
+  }
+  if(!state->profiling) {
+    // start from where the motor actually is
+    motion_profile_init(&state->profile, &config->profile, feedback != nullptr ? feedback->position : config->setpoint);
+    state->profiling = true;
+  }
+  if(memcmp(&state->profile.limits, &config->profile, sizeof(config->profile)) != 0) {
+    state->profile.limits = config->profile;
+    motion_profile_set_goal(&state->profile, config->setpoint);
+  } else if(state->profile.goal != config->setpoint) {
+    motion_profile_set_goal(&state->profile, config->setpoint);
+  }
+  return motion_profile_step(&state->profile, dt);
+}
+
+static float rev_feed_forward(const pid_gains* pid, const motion_profile_point* ref) {
+  float ff = pid->kv * ref->velocity + pid->ka * ref->acceleration;
+  if(ref->velocity > 0) ff += pid->ks;
+  if(ref->velocity < 0) ff -= pid->ks;
+  return ff;
+}
+
+// Builds the frame to send for this controller, or returns false if there's nothing to send this cycle
+static bool rev_controller_run(const rev_controller_config* config, rev_controller_state* state,
+    const rev_motor_info* info, float dt, can_msg* msg) {
+  rev_feedback_sample feedback = {};
+  if(info != nullptr) feedback = rev_read_feedback(config, info);
+  motion_profile_point ref = {config->setpoint, 0, 0};
+  if(config->mode == REV_CONTROL_POSITION || config->mode == REV_CONTROL_ONBOARD_POSITION) {
+    ref = rev_controller_reference(config, state, info != nullptr ? &feedback : nullptr, dt);
+  }
+  state->reference = ref.position;
+  if(info != nullptr) {
+    bool velocity = config->mode == REV_CONTROL_VELOCITY || config->mode == REV_CONTROL_ONBOARD_VELOCITY ||
+      config->mode == REV_CONTROL_ONBOARD_SMART_VELOCITY;
+    state->error = velocity ? config->setpoint - feedback.velocity : ref.position - feedback.position;
+    // onboard modes only know what the SPARK says it's putting out
+    state->output = info->applied_output / 32768.0f;
+  }
+  switch(config->mode) {
+    case REV_CONTROL_DUTY_CYCLE:
+      state->output = std::max(config->out_min, std::min(config->out_max, config->setpoint));
+      rev_make_duty_cycle_msg(msg, config->dev_num, state->output);
+      return true;
+    case REV_CONTROL_ONBOARD_POSITION:
+      rev_make_setpoint_msg(msg, config->dev_num, POSITION_SET, ref.position, rev_feed_forward(&config->pid, &ref), 0);
+      return true;
+    case REV_CONTROL_ONBOARD_VELOCITY:
+      // kV went over as kF, kS has to come along as arbitrary feed-forward
+      rev_make_setpoint_msg(msg, config->dev_num, SPEED_SET, config->setpoint,
+        config->setpoint > 0 ? config->pid.ks : config->setpoint < 0 ? -config->pid.ks : 0, 0);
+      return true;
+    case REV_CONTROL_ONBOARD_SMART_VELOCITY:
+      rev_make_setpoint_msg(msg, config->dev_num, SMART_VELOCITY_SET, config->setpoint, 0, 0);
+      return true;
+    case REV_CONTROL_ONBOARD_SMART_MOTION:
+      rev_make_setpoint_msg(msg, config->dev_num, SMART_MOTION_SET, config->setpoint, 0, 0);
+      return true;
+    default:
+      break;
+  }
+  if(config->mode == REV_CONTROL_OFF || info == nullptr) return false;
+
+  // gains are in volts per rotation (or rpm), which is more ergonomic than percent. the clamp is in duty cycle
+  pid_gains gains = config->pid;
+  gains.out_min = config->out_min * REV_NOMINAL_VOLTAGE;
+  gains.out_max = config->out_max * REV_NOMINAL_VOLTAGE;
+  float out;
+  if(config->mode == REV_CONTROL_VELOCITY) {
+    // the setpoint is the reference velocity, so kS/kV feed-forward apply directly
+    out = pid_update(&gains, &state->pid, config->setpoint, feedback.velocity, dt, config->setpoint);
+  } else {
+    out = pid_update(&gains, &state->pid, ref.position, feedback.position, dt, ref.velocity, ref.acceleration);
+  }
+  state->output = out / REV_NOMINAL_VOLTAGE;
+  rev_make_duty_cycle_msg(msg, config->dev_num, state->output);
+  return true;
+}
+
+static void rev_push_telemetry(telemetry_source source, telemetry_record_type type, int dev_num,
+    const rev_motor_info* info, uint32_t timestamp_us, float output, float error) {
+  telemetry_record record;
+  record.type = type;
+  record.device = dev_num;
+  record.timestamp_us = timestamp_us;
+  record.position = info->position;
+  record.velocity = info->velocity;
+  record.current = info->current;
+  record.output = output;
+  record.error = error;
+  telemetry_push(source, &record);
+}
+
+/* Normal controllers run on the timer below. Controllers with on_status set instead run as soon as can_task has
+ * decoded a fresh position (or velocity) frame for their motor, using the time between frames as dt, which takes
+ * up to a whole period of sampling latency out of the loop. can_task flags the device in rev_control_data_pending and
+ * pokes the task, the alarm bumps rev_control_ticks_pending, and the task works out which of the two woke it.
+ */
+static std::atomic<uint32_t> rev_control_data_pending[REV_MAX_DEVICES / 32];
+static std::atomic<uint32_t> rev_control_ticks_pending{0};
+
+/* Every timer cycle is one bus cycle: the heartbeat (when it's due) and every controller's setpoint get built up
+ * into one batch and queued back to back with a single can_send_msgs, so the bus sees one tight burst per cycle and
+ * nothing else has to wake up to send frames.
+ */
+
+/* The loop is clocked by a pico repeating timer (a hardware alarm irq) rather than vTaskDelay, so the period doesn't
+ * stretch by however long the work took, and it isn't limited to the 1 ms tick. The irq just notifies the task, and
+ * the task uses the actually measured time since its last run as dt.
+ * overruns counts alarms that fired while the previous cycle was still running, missed counts cycles that never ran
+ * at all because we were that far behind.
+ */
+struct rev_control_timing {
+  uint32_t cycles;
+  uint32_t overruns;
+  uint32_t missed;
+  uint32_t dt_min_us;
+  uint32_t dt_max_us;
+  uint32_t compute_max_us;
+  uint32_t gain_failures; // onboard gain sets the SPARK didn't take, each one gets sent again
+};
+
+static TaskHandle_t rev_control_task_handle = NULL;
+static repeating_timer_t rev_control_timer;
+static uint32_t rev_control_period_us = REV_CONTROL_PERIOD_US;
+static volatile bool rev_control_busy = false;
+static volatile bool rev_control_timing_reset = false;
+static rev_control_timing rev_control_timing_stats;
+
+static bool rev_control_alarm_cb(__unused repeating_timer_t* rt) {
+  BaseType_t woken = pdFALSE;
+  if(rev_control_busy) rev_control_timing_stats.overruns++;
+  rev_control_ticks_pending.fetch_add(1, std::memory_order_relaxed);
+  vTaskNotifyGiveFromISR(rev_control_task_handle, &woken);
+  portYIELD_FROM_ISR(woken);
+  return true;
+}
+
+static void rev_control_data_ready(int dev_num) {
+  if(rev_control_task_handle == NULL) return;
+  rev_control_data_pending[dev_num / 32].fetch_or(1u << (dev_num % 32), std::memory_order_release);
+  xTaskNotifyGive(rev_control_task_handle);
+}
+
+bool rev_control_set_period_us(uint32_t period_us) {
+  if(period_us < REV_CONTROL_MIN_PERIOD_US || period_us > REV_CONTROL_MAX_PERIOD_US) return false;
+  cancel_repeating_timer(&rev_control_timer);
+  rev_control_period_us = period_us;
+  rev_control_timing_reset = true;
+  // negative delay means the period is measured start to start, not end to start
+  return add_repeating_timer_us(-(int64_t) period_us, rev_control_alarm_cb, NULL, &rev_control_timer);
+}
+
+void rev_control_task(__unused void* params) {
+  rev_controller_config configs[REV_MAX_CONTROLLERS];
+  uint32_t epochs[REV_MAX_CONTROLLERS];
+  uint32_t gains_epochs[REV_MAX_CONTROLLERS];
+  bool active[REV_MAX_CONTROLLERS];
+  can_msg batch[2 * REV_MAX_CONTROLLERS + 1]; // stops, setpoints and the heartbeat
+  rev_control_timing* timing = &rev_control_timing_stats;
+
+  rev_control_task_handle = xTaskGetCurrentTaskHandle();
+  rev_control_set_period_us(rev_control_period_us);
+  uint32_t last_start = time_us_32();
+  uint32_t last_heartbeat = last_start;
   while(1) {
-    auto info = get_rev_motor_info(motor_controller_id);
-    if(info == NULL) {
-      vTaskDelay(pdMS_TO_TICKS(100));
-      continue;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    rev_control_busy = true;
+    uint32_t start = time_us_32();
+    uint32_t ticks = rev_control_ticks_pending.exchange(0, std::memory_order_relaxed);
+    uint32_t fresh[REV_MAX_DEVICES / 32];
+    for(int i = 0; i < REV_MAX_DEVICES / 32; i++) {
+      fresh[i] = rev_control_data_pending[i].exchange(0, std::memory_order_acquire);
     }
 
-    float error = pid_setpoint - info->position;
-    i_accum += error * (dt / 1000.0);
-    float p_term = error * pid_kp;
-    float i_term = i_accum * pid_ki;
-    float d_term = pid_kd * ((error - last_error) / (dt / 1000.0));
-    last_error = error;
+    float dt = 0;
+    if(ticks > 0) {
+      uint32_t dt_us = start - last_start;
+      last_start = start;
+      if(rev_control_timing_reset) {
+        *timing = {};
+        rev_control_timing_reset = false;
+        // the first dt after a period change is meaningless
+        dt_us = rev_control_period_us;
+      }
+      if(timing->cycles == 0 || dt_us < timing->dt_min_us) timing->dt_min_us = dt_us;
+      if(dt_us > timing->dt_max_us) timing->dt_max_us = dt_us;
+      timing->missed += ticks - 1;
+      timing->cycles++;
+      dt = dt_us / 1000000.0f;
+    }
+
+    critical_section_enter_blocking(&rev_control_lock);
+    for(int i = 0; i < REV_MAX_CONTROLLERS; i++) {
+      active[i] = rev_controllers[i].used;
+      configs[i] = rev_controllers[i].config;
+      epochs[i] = rev_controllers[i].epoch;
+      gains_epochs[i] = rev_controllers[i].gains_epoch;
+    }
+    critical_section_exit(&rev_control_lock);
 
-    float out = p_term + i_term + d_term;
-    out /= 12.0f; // volts / rotation is more ergonomic than percent / rotation
-    out = std::max(-0.1f, std::min(0.3f, out));
-    printf("out: %f\n", out);
-    rev_send_duty_cycle(motor_controller_id, out);
-    vTaskDelay(pdMS_TO_TICKS(dt));
+    size_t count = 0;
+    // half a period of slack so alarm jitter doesn't make us skip a whole cycle at 100 Hz
+    if(ticks > 0 && heartbeat_enabled && start - last_heartbeat + rev_control_period_us / 2 >= REV_HEARTBEAT_PERIOD_US) {
+      rev_make_heartbeat_msg(&batch[count++], motor_controller_id);
+      last_heartbeat = start;
+    }
+    // ahead of the setpoints, so a controller that's been re-added since still gets the last word
+    for(int i = 0; ticks > 0 && i < REV_MAX_DEVICES / 32; i++) {
+      uint32_t stops = rev_control_stop_pending[i].exchange(0, std::memory_order_relaxed);
+      while(stops != 0) {
+        int bit = __builtin_ctz(stops);
+        stops &= stops - 1;
+        if(count >= REV_MAX_CONTROLLERS) {
+          // whatever doesn't fit goes next cycle
+          rev_control_stop_pending[i].fetch_or(1u << bit, std::memory_order_relaxed);
+          continue;
+        }
+        rev_make_duty_cycle_msg(&batch[count++], i * 32 + bit, 0.0f);
+      }
+    }
+    for(int i = 0; i < REV_MAX_CONTROLLERS; i++) {
+      if(!active[i]) continue;
+      const rev_controller_config* config = &configs[i];
+      bool data_driven = config->on_status && (config->mode == REV_CONTROL_POSITION || config->mode == REV_CONTROL_VELOCITY);
+      bool is_fresh = fresh[config->dev_num / 32] & (1u << (config->dev_num % 32));
+      if(data_driven ? !is_fresh : ticks == 0) continue;
+
+      rev_controller_state* state = &rev_controller_states[i];
+      if(state->epoch != epochs[i]) {
+        *state = {};
+        state->epoch = epochs[i];
+      }
+      if(rev_control_mode_is_onboard(config->mode) && state->gains_epoch != gains_epochs[i]) {
+        // setpoints keep going out meanwhile, the SPARK just runs them on whatever gains it had
+        if(rev_push_onboard_gains(&rev_gain_pushes[i], config, gains_epochs[i], start, &timing->gain_failures)) {
+          state->gains_epoch = gains_epochs[i];
+        }
+      }
+      rev_motor_info info;
+      bool have_info = rev_get_motor_info(config->dev_num, &info);
+      float controller_dt = dt;
+      if(data_driven) {
+        // no snapshot, no timestamp. leave last_sample_us alone so the next good frame still gets the right dt
+        if(!have_info) continue;
+        rev_feedback_sample feedback = rev_read_feedback(config, &info);
+        uint32_t sample_us = config->mode == REV_CONTROL_VELOCITY ? feedback.velocity_us : feedback.position_us;
+        // first frame after (re)starting has nothing to difference against, just take a sample
+        bool first = state->last_sample_us == 0;
+        controller_dt = (sample_us - state->last_sample_us) / 1000000.0f;
+        state->last_sample_us = sample_us;
+        if(first || controller_dt <= 0) continue;
+      }
+      if(rev_controller_run(config, state, have_info ? &info : nullptr, controller_dt, &batch[count])) {
+        count++;
+        if(have_info) {
+          rev_push_telemetry(TELEMETRY_SOURCE_CONTROL, TELEMETRY_CONTROL, config->dev_num, &info, start, state->output, state->error);
+        }
+      }
+    }
+    if(count > 0) can_send_msgs(batch, count);
+
+    uint32_t compute = time_us_32() - start;
+    if(compute > timing->compute_max_us) timing->compute_max_us = compute;
+    rev_control_busy = false;
+  }
+}
+
+static const char* rev_control_mode_names[] = {"off", "duty", "pos", "vel", "onpos", "onvel", "onsvel", "onmotion"};
+#define REV_CONTROL_MODE_COUNT (sizeof(rev_control_mode_names) / sizeof(rev_control_mode_names[0]))
+
+static bool rev_parse_control_mode(const char* param, BaseType_t len, rev_control_mode* mode) {
+  for(size_t i = 0; i < REV_CONTROL_MODE_COUNT; i++) {
+    if(rev_token_is(param, len, rev_control_mode_names[i])) {
+      *mode = (rev_control_mode) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char* rev_feedback_names[] = {"primary", "analog", "alt", "abs"};
+#define REV_FEEDBACK_COUNT (sizeof(rev_feedback_names) / sizeof(rev_feedback_names[0]))
+
+static bool rev_parse_feedback(const char* param, BaseType_t len, rev_feedback_source* feedback) {
+  for(size_t i = 0; i < REV_FEEDBACK_COUNT; i++) {
+    if(rev_token_is(param, len, rev_feedback_names[i])) {
+      *feedback = (rev_feedback_source) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static BaseType_t control_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  BaseType_t len;
+  const char* dev_param = FreeRTOS_CLIGetParameter(pcCommandString, 1, &len);
+  if(dev_param == nullptr) {
+    rev_control_timing t = rev_control_timing_stats;
+    size_t out = snprintf(pcWriteBuffer, xWriteBufferLen,
+      "Period %u us, %u cycles, dt min %u max %u us, compute max %u us, %u overruns, %u missed, %u gain push failures\r\n",
+      rev_control_period_us, t.cycles, t.dt_min_us, t.dt_max_us, t.compute_max_us, t.overruns, t.missed,
+      t.gain_failures);
+    for(int i = 0; i < REV_MAX_CONTROLLERS && out < xWriteBufferLen; i++) {
+      critical_section_enter_blocking(&rev_control_lock);
+      bool used = rev_controllers[i].used;
+      rev_controller_config c = rev_controllers[i].config;
+      critical_section_exit(&rev_control_lock);
+      if(!used) continue;
+      out += snprintf(pcWriteBuffer + out, xWriteBufferLen - out,
+        "Motor %d: %s%s fb %s sp %f kp %f ki %f kd %f ks %f kv %f ka %f imax %f kaw %f dtau %f slew %f out [%f, %f]"
+        " profile v %f a %f j %f\r\n",
+        c.dev_num, rev_control_mode_names[c.mode], c.on_status ? " (on status)" : "", rev_feedback_names[c.feedback],
+        c.setpoint, c.pid.kp, c.pid.ki, c.pid.kd, c.pid.ks, c.pid.kv, c.pid.ka, c.pid.i_max, c.pid.kaw, c.pid.d_filter_tau, c.pid.slew_rate,
+        c.out_min, c.out_max, c.profile.max_velocity, c.profile.max_acceleration, c.profile.max_jerk);
+    }
+    return pdFALSE;
+  }
+  if(rev_token_is(dev_param, len, "rate")) {
+    const char* hz = FreeRTOS_CLIGetParameter(pcCommandString, 2, nullptr);
+    bool ok = hz != nullptr && atoi(hz) > 0 && rev_control_set_period_us(1000000 / atoi(hz));
+    snprintf(pcWriteBuffer, xWriteBufferLen, ok ? "OK\r\n" : "Bad rate\r\n");
+    return pdFALSE;
   }
+
+  int dev_num = atoi(dev_param);
+  const char* cmd = FreeRTOS_CLIGetParameter(pcCommandString, 2, &len);
+  BaseType_t arg1_len;
+  const char* arg1 = FreeRTOS_CLIGetParameter(pcCommandString, 3, &arg1_len);
+  const char* arg2 = FreeRTOS_CLIGetParameter(pcCommandString, 4, nullptr);
+  const char* arg3 = FreeRTOS_CLIGetParameter(pcCommandString, 5, nullptr);
+  rev_control_mode mode;
+  rev_feedback_source feedback;
+  rev_controller_config config;
+  bool ok = false;
+  if(cmd == nullptr) {
+    ok = false;
+  } else if(rev_parse_control_mode(cmd, len, &mode)) {
+    ok = rev_controller_add(dev_num, mode);
+  } else if(rev_token_is(cmd, len, "rm")) {
+    rev_controller_remove(dev_num);
+    ok = true;
+  } else if((rev_token_is(cmd, len, "timer") || rev_token_is(cmd, len, "onstatus")) && rev_controller_get(dev_num, &config)) {
+    config.on_status = cmd[0] == 'o';
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "sp") && arg1 != nullptr) {
+    ok = rev_controller_set_setpoint(dev_num, atof(arg1));
+  } else if(rev_token_is(cmd, len, "pid") && arg3 != nullptr) {
+    ok = rev_controller_set_gains(dev_num, atof(arg1), atof(arg2), atof(arg3));
+  } else if(rev_token_is(cmd, len, "ff") && arg3 != nullptr && rev_controller_get(dev_num, &config)) {
+    config.pid.ks = atof(arg1);
+    config.pid.kv = atof(arg2);
+    config.pid.ka = atof(arg3);
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "aw") && arg2 != nullptr && rev_controller_get(dev_num, &config)) {
+    config.pid.i_max = atof(arg1);
+    config.pid.kaw = atof(arg2);
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "dtau") && arg1 != nullptr && rev_controller_get(dev_num, &config)) {
+    config.pid.d_filter_tau = atof(arg1);
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "profile") && arg2 != nullptr && rev_controller_get(dev_num, &config)) {
+    config.profile.max_velocity = atof(arg1);
+    config.profile.max_acceleration = atof(arg2);
+    config.profile.max_jerk = arg3 != nullptr ? atof(arg3) : 0;
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "slew") && arg1 != nullptr && rev_controller_get(dev_num, &config)) {
+    config.pid.slew_rate = atof(arg1);
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "fb") && arg1 != nullptr &&
+      rev_parse_feedback(arg1, arg1_len, &feedback) && rev_controller_get(dev_num, &config)) {
+    config.feedback = feedback;
+    ok = rev_controller_set(&config);
+  } else if(rev_token_is(cmd, len, "lim") && arg2 != nullptr && rev_controller_get(dev_num, &config)) {
+    config.out_min = atof(arg1);
+    config.out_max = atof(arg2);
+    ok = rev_controller_set(&config);
+  }
+  snprintf(pcWriteBuffer, xWriteBufferLen, ok ? "OK\r\n" : "Failed (no such controller, table full or bad args)\r\n");
+  return pdFALSE;
+}
+
+static const char* rev_param_status_names[] = {"pending", "ok", "timeout", "error"};
+
+static int rev_print_param_value(char* buf, size_t len, const rev_param_request* req) {
+  switch(req->type) {
+    case PARAM_TYPE_FLOAT: return snprintf(buf, len, "%f", req->value.f);
+    case PARAM_TYPE_INT: return snprintf(buf, len, "%ld", (long) req->value.i);
+    case PARAM_TYPE_BOOL: return snprintf(buf, len, "%s", req->value.u ? "true" : "false");
+    default: return snprintf(buf, len, "%lu", (unsigned long) req->value.u);
+  }
+}
+
+static BaseType_t param_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  const char* dev = FreeRTOS_CLIGetParameter(pcCommandString, 1, nullptr);
+  BaseType_t param_len;
+  const char* param = FreeRTOS_CLIGetParameter(pcCommandString, 2, &param_len);
+  const char* value = FreeRTOS_CLIGetParameter(pcCommandString, 3, nullptr);
+  const char* type = FreeRTOS_CLIGetParameter(pcCommandString, 4, nullptr);
+  if(dev == nullptr) {
+    rev_param_stats stats;
+    critical_section_enter_blocking(&rev_param_lock);
+    stats = rev_param_counts;
+    critical_section_exit(&rev_param_lock);
+    snprintf(pcWriteBuffer, xWriteBufferLen, "requests %lu retries %lu timeouts %lu errors %lu max in flight %lu queued %lu\r\n",
+             (unsigned long) stats.requests, (unsigned long) stats.retries, (unsigned long) stats.timeouts,
+             (unsigned long) stats.errors, (unsigned long) stats.max_inflight, (unsigned long) rev_param_used);
+    return pdFALSE;
+  }
+  if(param == nullptr) {
+    snprintf(pcWriteBuffer, xWriteBufferLen, "Bad args\r\n");
+    return pdFALSE;
+  }
+  int dev_num = atoi(dev);
+  if(rev_token_is(param, param_len, "burn")) {
+    snprintf(pcWriteBuffer, xWriteBufferLen, rev_param_burn_flash(dev_num) ? "Sent\r\n" : "Failed\r\n");
+    return pdFALSE;
+  }
+  int param_id = strtol(param, nullptr, 0);
+  if(dev_num < 0 || dev_num >= REV_MAX_DEVICES || param_id < 0 || param_id >= SPARK_MAX_PARAMETER_COUNT) {
+    snprintf(pcWriteBuffer, xWriteBufferLen, "Bad args\r\n");
+    return pdFALSE;
+  }
+
+  rev_param_request req = {};
+  req.dev_num = dev_num;
+  req.param_id = param_id;
+  if(value != nullptr) {
+    req.write = true;
+    if(type == nullptr || type[0] == 'f') {
+      req.type = PARAM_TYPE_FLOAT;
+      req.value.f = atof(value);
+    } else if(type[0] == 'i') {
+      req.type = PARAM_TYPE_INT;
+      req.value.i = atoi(value);
+    } else {
+      req.type = type[0] == 'b' ? PARAM_TYPE_BOOL : PARAM_TYPE_UINT;
+      req.value.u = strtoul(value, nullptr, 0);
+    }
+  }
+  uint32_t start = time_us_32();
+  if(!rev_param_transfer(&req, 1) && req.status == REV_PARAM_PENDING) {
+    snprintf(pcWriteBuffer, xWriteBufferLen, "Failed (request table full)\r\n");
+    return pdFALSE;
+  }
+  uint32_t elapsed = time_us_32() - start;
+  int n = snprintf(pcWriteBuffer, xWriteBufferLen, "%s in %lu us", rev_param_status_names[req.status], (unsigned long) elapsed);
+  if(req.status == REV_PARAM_OK && n > 0 && (size_t) n < xWriteBufferLen) {
+    n += snprintf(pcWriteBuffer + n, xWriteBufferLen - n, ": ");
+    if((size_t) n < xWriteBufferLen) n += rev_print_param_value(pcWriteBuffer + n, xWriteBufferLen - n, &req);
+  } else if(req.status == REV_PARAM_ERROR && n > 0 && (size_t) n < xWriteBufferLen) {
+    n += snprintf(pcWriteBuffer + n, xWriteBufferLen - n, " (code %d)", req.response_code);
+  }
+  if(n > 0 && (size_t) n < xWriteBufferLen) snprintf(pcWriteBuffer + n, xWriteBufferLen - n, "\r\n");
+  return pdFALSE;
+}
+
+static const CLI_Command_Definition_t xParamCommand = {
+  "param",
+  "param [<n> <id> [<value> [float|int|uint|bool]] | <n> burn]:\r\n"
+  "  Show parameter engine stats, read or write (defaults to float) a SPARK MAX parameter, or save them to flash\r\n",
+  param_command,
+  -1
+};
+
+static const CLI_Command_Definition_t xControlCommand = {
+  "ctl",
+  "ctl [<n> off|duty|pos|vel|onpos|onvel|onsvel|onmotion|rm | <n> timer|onstatus | <n> sp <setpoint> | <n> pid <kp> <ki> <kd> | <n> lim <min> <max> |\r\n"
+  "     <n> ff <ks> <kv> <ka> | <n> aw <imax> <kaw> | <n> dtau <s> | <n> slew <v/s> |\r\n"
+  "     <n> profile <max vel> <max accel> [max jerk] | <n> fb primary|analog|alt|abs | rate <hz>]:\r\n"
+  "  Show loop timing and the motor controllers, add/change/remove the one for motor n, or set the loop rate\r\n"
+  "  (100 to 2000 Hz).\r\n"
+  "  Gains, feed-forward, the integrator limit and slew are in volts. on* modes run the loop on the SPARK itself.\r\n"
+  "  Position setpoints follow a trapezoid (or S-curve with a jerk limit) profile, max vel 0 turns it off.\r\n"
+  "  onmotion/onsvel hand the profile to the SPARK instead (onsvel accel in rpm/s) and don't move without one.\r\n"
+  "  fb picks the sensor pos/vel close on: the motor encoder, analog input, alt encoder or absolute encoder\r\n",
+  control_command,
+  -1
+};
+
+void rev_control_init() {
+  critical_section_init(&rev_control_lock);
+  // what the old single motor pid loop did
+  rev_controller_add(motor_controller_id, REV_CONTROL_POSITION);
+  rev_controller_config config;
+  rev_controller_get(motor_controller_id, &config);
+  config.out_min = -0.1f;
+  config.out_max = 0.3f;
+  // gentle enough that a fast spin of the knob doesn't hit the clamp
+  config.profile.max_velocity = 2.0f;
+  config.profile.max_acceleration = 4.0f;
+  rev_controller_set(&config);
 }
 
 float rev_get_position() {
-  auto info = get_rev_motor_info(motor_controller_id);
-  if(info == NULL) return 0.0;
-  return info->position;
+
+  rev_motor_info info;
+  if(!rev_get_motor_info(motor_controller_id, &info)) return 0.0;
+  return info.position;
 }
 
 float rev_get_velocity() {
-  auto info = get_rev_motor_info(motor_controller_id);
-  if(info == NULL) return 0.0;
-  return info->velocity;
+  rev_motor_info info;
+  if(!rev_get_motor_info(motor_controller_id, &info)) return 0.0;
+  return info.velocity;
 }
 
 float rev_get_error() {
-  auto info = get_rev_motor_info(motor_controller_id);
-  if(info == NULL) return 0.0;
-  return pid_setpoint - info->position;
+  rev_motor_info info;
+  rev_controller_config config;
+  if(!rev_get_motor_info(motor_controller_id, &info) || !rev_controller_get(motor_controller_id, &config)) return 0.0;
+  return config.setpoint - info.position;
+}
+
+// Where the profile has got to on the way to the setpoint
+float rev_get_reference() {
+  float reference;
+  if(!rev_controller_get_reference(motor_controller_id, &reference)) return 0.0;
+  return reference;
 }
 
 void rev_set_setpoint(float setpoint) {
-  pid_setpoint = setpoint;
+  rev_controller_set_setpoint(motor_controller_id, setpoint);
 }
 
 void rev_fun_task(__unused void* params) {
-  TaskHandle_t pid_task_h;
-  xTaskCreate(pid_task, "PID Task", 2048, NULL, 1, &pid_task_h);
-  vTaskCoreAffinitySet(pid_task_h, 1);
+  TaskHandle_t control_task_h;
+  xTaskCreate(rev_control_task, "REV Control", 2048, NULL, 2, &control_task_h);
+  vTaskCoreAffinitySet(control_task_h, 1);
+  // sleeps between reports instead of spinning on the tick count, heartbeats go out with the control loop now
+  TickType_t last_wake = xTaskGetTickCount();
   while(1) {
-    if(heartbeat_enabled) {
-      if(abs(xTaskGetTickCount() - lastHeartbeatTime) > pdMS_TO_TICKS(10)) {
-        lastHeartbeatTime = xTaskGetTickCount();
-        rev_send_heartbeat(motor_controller_id);
-      }
-    }
-    if(abs(xTaskGetTickCount() - lastPrintTime) > pdMS_TO_TICKS(200)) {
-      lastPrintTime = xTaskGetTickCount();
-      for(auto& [dev_num, info] : rev_motor_infos) {
-        if(rev_motor_fell_off(dev_num)) {
-          printf("Motor %d fell off %d\n", dev_num, xTaskGetTickCount() - info.last_pf0);
-          continue;
-        }
-        printf("Motor %d: Applied output: %d, Velocity: %f, Position: %f, Current: %f, Voltage: %f, Temperature: %d, Faults: %d, Sticky faults: %d, Follower data: %d\n", dev_num, info.applied_output, info.velocity, info.position, info.current, info.voltage, info.temperature, info.faults, info.sticky_faults, info.follower_data);
-      }
+    xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(REV_TELEMETRY_PERIOD_MS));
+    // one binary record per motor rather than a printf'd wall of floats, see telemetry_decode.py
+    for(int dev_num = 0; dev_num < REV_MAX_DEVICES; dev_num++) {
+      rev_motor_info info;
+      if(!rev_get_motor_info(dev_num, &info) || rev_motor_fell_off(dev_num)) continue;
+      rev_push_telemetry(TELEMETRY_SOURCE_STATUS, TELEMETRY_STATUS, dev_num, &info, info.last_pf0,
+        info.applied_output / 32768.0f, 0);
     }
   }
 }
 
+// Gains for the OLED's motor. Read-modify-write isn't atomic, but only the OLED task calls these.
+static void rev_update_gains(float* kp, float* ki, float* kd) {
+  rev_controller_config config;
+  if(!rev_controller_get(motor_controller_id, &config)) return;
+  rev_controller_set_gains(motor_controller_id, kp ? *kp : config.pid.kp, ki ? *ki : config.pid.ki, kd ? *kd : config.pid.kd);
+}
+
+static float rev_get_gain(float pid_gains::* gain) {
+  rev_controller_config config;
+  if(!rev_controller_get(motor_controller_id, &config)) return 0.0;
+  return config.pid.*gain;
+}
+
 void rev_set_kp(float kp) {
-  pid_kp = kp;
+  rev_update_gains(&kp, nullptr, nullptr);
 }
 
 void rev_set_ki(float ki) {
-  pid_ki = ki;
+  rev_update_gains(nullptr, &ki, nullptr);
 }
 
 void rev_set_kd(float kd) {
-  pid_kd = kd;
+  rev_update_gains(nullptr, nullptr, &kd);
 }
 
 float rev_get_kp() {
-  return pid_kp;
+  return rev_get_gain(&pid_gains::kp);
 }
 
 float rev_get_ki() {
-  return pid_ki;
+  return rev_get_gain(&pid_gains::ki);
 }
 
 float rev_get_kd() {
-  return pid_kd;
-}
\ No newline at end of file
+  return rev_get_gain(&pid_gains::kd);
+}
+
+void rev_register_commands() {
+  FreeRTOS_CLIRegisterCommand(&xRevCommand);
+  FreeRTOS_CLIRegisterCommand(&xRevCommand2);
+  FreeRTOS_CLIRegisterCommand(&xMotorCommand);
+  FreeRTOS_CLIRegisterCommand(&xRevBenchCommand);
+  FreeRTOS_CLIRegisterCommand(&xRevStatsCommand);
+  FreeRTOS_CLIRegisterCommand(&xControlCommand);
+  FreeRTOS_CLIRegisterCommand(&xParamCommand);
+}
@@ -1,7 +1,141 @@
 #pragma once
+#include <cstddef>
+#include "FreeRTOS.h"
+#include "task.h"
 #include "can.h"
+#include "pid.h"
+#include "motion_profile.h"
+
+struct rev_motor_info {
+  int16_t applied_output;
+  float velocity;
+  float position;
+  float current;
+  float voltage;
+  uint8_t temperature;
+  uint16_t faults;
+  uint16_t sticky_faults;
+  uint8_t follower_data;
+  // status 3, analog input
+  uint16_t analog_voltage_raw; // 10 bit adc reading
+  int32_t analog_velocity_raw; // 22 bit signed, sign extended
+  float analog_position;
+  // status 4, alternate encoder
+  float alt_encoder_velocity;
+  float alt_encoder_position;
+  // status 5/6, duty cycle (absolute) encoder
+  float duty_cycle_position;
+  uint16_t duty_cycle_absolute_angle;
+  float duty_cycle_velocity;
+  uint16_t duty_cycle_frequency;
+  // status 7, undocumented so just keep the bytes
+  uint8_t status7_data[8];
+  // rx timestamps (time_us_32()) of the last frame of each kind
+  uint32_t last_pf0;
+  uint32_t last_pf1;
+  uint32_t last_pf2;
+  uint32_t last_pf3;
+  uint32_t last_pf4;
+  uint32_t last_pf5;
+  uint32_t last_pf6;
+  uint32_t last_pf7;
+};
+
+// Copies out a consistent snapshot of a motor's latest status. Safe from any task on either core, never sleeps, at
+// worst it spins for the few dozen cycles can_task takes to update the record. Returns false if we've never heard
+// from that device.
+bool rev_get_motor_info(int dev_num, rev_motor_info* out);
+
+enum rev_control_mode {
+  REV_CONTROL_OFF,
+  REV_CONTROL_DUTY_CYCLE, // setpoint goes straight out as the duty cycle
+  REV_CONTROL_POSITION,   // pid on position, rotations
+  REV_CONTROL_VELOCITY,   // pid on velocity, rpm
+  // the SPARK runs the loop itself from gains we push over parameter access, we just stream setpoints
+  REV_CONTROL_ONBOARD_POSITION,
+  REV_CONTROL_ONBOARD_VELOCITY,
+  REV_CONTROL_ONBOARD_SMART_VELOCITY,
+  REV_CONTROL_ONBOARD_SMART_MOTION,
+};
+
+// What the host side POSITION/VELOCITY loops measure. The onboard modes always close on the motor's own encoder
+enum rev_feedback_source {
+  REV_FEEDBACK_PRIMARY,     // the motor's encoder, status 1 (velocity) and 2 (position)
+  REV_FEEDBACK_ANALOG,      // analog input, status 3. Velocity is the raw reading, there's no scale for it
+  REV_FEEDBACK_ALT_ENCODER, // status 4
+  REV_FEEDBACK_ABSOLUTE,    // duty cycle encoder, status 5 (position) and 6 (velocity)
+};
+
+struct rev_controller_config {
+  int dev_num;
+  rev_control_mode mode;
+  rev_feedback_source feedback;
+  pid_gains pid; // volts per rotation (position) or per rpm (velocity)
+  float setpoint;
+  // duty cycle clamp
+  float out_min;
+  float out_max;
+  // run when a fresh position/velocity frame for this motor arrives instead of on the control timer
+  bool on_status;
+  // position modes only, max_velocity <= 0 sends setpoints straight through. The smart modes get these pushed to the
+  // SPARK instead (smart motion in rotations/s and /s^2, smart velocity's acceleration in rpm/s), and won't move
+  // while they're 0
+  motion_profile_limits profile;
+};
+
+// Controller table, all run from one task. These are safe to call from any task.
+void rev_control_init();
+bool rev_control_set_period_us(uint32_t period_us);
+bool rev_controller_add(int dev_num, rev_control_mode mode); // also changes the mode of an existing controller
+void rev_controller_remove(int dev_num);
+bool rev_controller_get(int dev_num, rev_controller_config* out);
+bool rev_controller_set(const rev_controller_config* config); // matched on config->dev_num
+bool rev_controller_set_setpoint(int dev_num, float setpoint);
+bool rev_controller_set_gains(int dev_num, float kp, float ki, float kd);
+bool rev_controller_get_reference(int dev_num, float* reference); // the profiled setpoint the loop is following
+
+enum rev_param_status {
+  REV_PARAM_PENDING,
+  REV_PARAM_OK,
+  REV_PARAM_TIMEOUT, // no reply after all the retries
+  REV_PARAM_ERROR,   // the SPARK replied with a non zero response code
+};
+
+struct rev_param_request {
+  int dev_num;
+  int param_id;
+  bool write;
+  uint8_t type; // 0 int, 1 uint, 2 float, 3 bool. Needed for writes, filled in from the reply for both
+  union {
+    uint32_t u;
+    int32_t i;
+    float f;
+  } value; // replaced with what the SPARK reports once the request completes
+  uint8_t response_code;
+  volatile rev_param_status status;
+};
+
+// Completions are given on their own notification index so they don't get mixed up with whatever else wakes the task
+#define REV_PARAM_NOTIFY_INDEX 1
+
+// A set of requests that complete together. The engine holds on to the pointers until remaining hits 0, so the
+// batch and its requests have to outlive that. notify (may be null) gets an xTaskNotifyGiveIndexed on
+// REV_PARAM_NOTIFY_INDEX when the last one is done.
+struct rev_param_batch {
+  rev_param_request* requests;
+  size_t count;
+  volatile size_t remaining;
+  TaskHandle_t notify;
+};
+
+// Pipelined parameter reads/writes with retries, see the comment above the engine in rev.cpp
+void rev_param_init();
+bool rev_param_submit(rev_param_batch* batch); // false if the request table is full or a request is bad
+bool rev_param_transfer(rev_param_request* requests, size_t count); // blocks until done, true if they all came back OK
+bool rev_param_burn_flash(int dev_num); // save the current parameters on the SPARK, fire and forget
 
 void rev_can_frame_callback(struct can_msg* frame);
+void rev_can_frames_callback(struct can_msg* frames, size_t count);
 void rev_fun_task(void* params);
 void rev_register_commands();
 
@@ -9,6 +143,7 @@ float rev_get_position();
 float rev_get_velocity();
 float rev_get_error();
 void rev_set_setpoint(float setpoint);
+float rev_get_reference();
 
 float rev_get_kp();
 float rev_get_ki();
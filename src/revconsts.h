@@ -127,6 +127,46 @@ enum SPARK_MAX_CAN_API {
     BROADCAST_NOT_A_COMMAND = 0x90,
     NON_ROBORIO_BROADCAST_NOT_A_COMMAND = 0xB0
 };
+
+// Parameter ids for PARAMETER_ACCESS (api 0x300 + id). Only the ones we use, the closed loop slots
+// are 8 apart and the smart motion ones 5.
+enum SPARK_MAX_PARAMETER {
+    PARAM_CAN_ID = 0,
+    PARAM_INPUT_MODE = 1,
+    PARAM_MOTOR_TYPE = 2,
+    PARAM_COMM_ADVANCE = 3,
+    PARAM_SENSOR_TYPE = 4,
+    PARAM_CTRL_TYPE = 5,
+    PARAM_IDLE_MODE = 6,
+    PARAM_INPUT_DEADBAND = 7,
+    PARAM_FEEDBACK_SENSOR_PID0 = 8,
+    PARAM_FEEDBACK_SENSOR_PID1 = 9,
+    PARAM_POLE_PAIRS = 10,
+    PARAM_CURRENT_CHOP = 11,
+    PARAM_CURRENT_CHOP_CYCLES = 12,
+    PARAM_P_0 = 13,
+    PARAM_I_0 = 14,
+    PARAM_D_0 = 15,
+    PARAM_F_0 = 16,
+    PARAM_IZONE_0 = 17,
+    PARAM_DFILTER_0 = 18,
+    PARAM_OUTPUT_MIN_0 = 19,
+    PARAM_OUTPUT_MAX_0 = 20,
+    PARAM_SMART_MOTION_MAX_VELOCITY_0 = 76, // rpm
+    PARAM_SMART_MOTION_MAX_ACCEL_0 = 77,    // rpm/s
+};
+
+#define SPARK_MAX_PID_SLOT_STRIDE 8
+#define SPARK_MAX_SMART_MOTION_SLOT_STRIDE 5
+#define SPARK_MAX_PARAMETER_COUNT 0x100
+
+// Byte 4 of a parameter access frame, same order as REVLib's ParameterType
+enum SPARK_MAX_PARAMETER_TYPE {
+    PARAM_TYPE_INT = 0,
+    PARAM_TYPE_UINT = 1,
+    PARAM_TYPE_FLOAT = 2,
+    PARAM_TYPE_BOOL = 3,
+};
 #include <map>
 #include <string>
 
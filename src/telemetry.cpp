@@ -0,0 +1,86 @@
+#include "telemetry.h"
+#include <cstddef>
+#include <cstdio>
+#include "tusb.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "fifo.h"
+#include "FreeRTOS-Plus-CLI/FreeRTOS_CLI.h"
+
+// A bit over a quarter second of a full controller table at 1 kHz
+#define TELEMETRY_QUEUE_SIZE 256
+
+static spsc_fifo<telemetry_record, TELEMETRY_QUEUE_SIZE> telemetry_queues[TELEMETRY_SOURCE_COUNT];
+static uint16_t telemetry_seq[TELEMETRY_SOURCE_COUNT];
+static TaskHandle_t telemetry_task_handle = NULL;
+static volatile bool telemetry_enabled = true;
+static volatile bool telemetry_listening = false;
+static uint32_t telemetry_sent = 0;
+
+// Records are short enough that the sums can't overflow 32 bits, so the mod only has to happen once at the end
+static uint16_t telemetry_checksum(const uint8_t* data, size_t len) {
+  uint32_t a = 0, b = 0;
+  for(size_t i = 0; i < len; i++) {
+    a += data[i];
+    b += a;
+  }
+  return ((b % 255) << 8) | (a % 255);
+}
+
+void telemetry_push(telemetry_source source, telemetry_record* record) {
+  if(!telemetry_enabled || !telemetry_listening) return;
+  record->magic = TELEMETRY_MAGIC;
+  record->seq = telemetry_seq[source]++;
+  record->checksum = telemetry_checksum((const uint8_t*) record, offsetof(telemetry_record, checksum));
+  if(telemetry_queues[source].push(*record) && telemetry_task_handle != NULL) {
+    xTaskNotifyGive(telemetry_task_handle);
+  }
+}
+
+void telemetry_task(__unused void* params) {
+  telemetry_task_handle = xTaskGetCurrentTaskHandle();
+  while(1) {
+    bool pending = false;
+    // only bother the producers when a host actually has the port open (DTR set)
+    telemetry_listening = tud_cdc_n_connected(TELEMETRY_CDC_ITF);
+    for(int source = 0; source < TELEMETRY_SOURCE_COUNT; source++) {
+      telemetry_record record;
+      while(tud_cdc_n_write_available(TELEMETRY_CDC_ITF) >= sizeof(record) && telemetry_queues[source].pop(&record)) {
+        tud_cdc_n_write(TELEMETRY_CDC_ITF, &record, sizeof(record));
+        telemetry_sent++;
+      }
+      if(!telemetry_listening) {
+        while(telemetry_queues[source].pop(&record)) {}
+      }
+      pending |= !telemetry_queues[source].is_empty();
+    }
+    tud_cdc_n_write_flush(TELEMETRY_CDC_ITF);
+    // if the usb buffer was full, check back next tick rather than waiting for another record to wake us
+    ulTaskNotifyTake(pdTRUE, pending ? 1 : pdMS_TO_TICKS(100));
+  }
+}
+
+static BaseType_t telemetry_command(char* pcWriteBuffer, size_t xWriteBufferLen, const char* pcCommandString) {
+  BaseType_t len;
+  const char* param = FreeRTOS_CLIGetParameter(pcCommandString, 1, &len);
+  if(param != nullptr) {
+    telemetry_enabled = param[0] == 'o' && len > 1 && param[1] == 'n';
+  }
+  snprintf(pcWriteBuffer, xWriteBufferLen,
+    "Telemetry %s, host %s, %u records sent, dropped: control %u status %u, ring high water: control %u status %u\r\n",
+    telemetry_enabled ? "on" : "off", telemetry_listening ? "connected" : "not connected", telemetry_sent,
+    telemetry_queues[TELEMETRY_SOURCE_CONTROL].overflows.load(), telemetry_queues[TELEMETRY_SOURCE_STATUS].overflows.load(),
+    telemetry_queues[TELEMETRY_SOURCE_CONTROL].high_water.load(), telemetry_queues[TELEMETRY_SOURCE_STATUS].high_water.load());
+  return pdFALSE;
+}
+
+static const CLI_Command_Definition_t xTelemetryCommand = {
+  "telem",
+  "telem [on|off]: Show binary telemetry stats, or turn it on/off\r\n",
+  telemetry_command,
+  -1
+};
+
+void telemetry_register_commands() {
+  FreeRTOS_CLIRegisterCommand(&xTelemetryCommand);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+
+/* Binary telemetry, streamed over a second CDC port so it doesn't get tangled up with the console.
+ * Records are fixed size, little endian, and start with TELEMETRY_MAGIC so a reader can resync. telemetry_decode.py
+ * in the repo root knows the layout, keep the two in step.
+ */
+#define TELEMETRY_MAGIC 0x5AA5
+#define TELEMETRY_CDC_ITF 1
+
+enum telemetry_record_type : uint8_t {
+  TELEMETRY_CONTROL = 1, // one per controller run
+  TELEMETRY_STATUS = 2,  // periodic dump of every motor we've heard from
+};
+
+// Each producer gets its own lock-free ring, so there must only ever be one task pushing per source
+enum telemetry_source {
+  TELEMETRY_SOURCE_CONTROL,
+  TELEMETRY_SOURCE_STATUS,
+  TELEMETRY_SOURCE_COUNT
+};
+
+struct [[gnu::packed]] telemetry_record {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t device;
+  uint32_t timestamp_us;
+  float position;
+  float velocity;
+  float current;
+  float output; // duty cycle
+  float error;
+  uint16_t seq; // per source, gaps mean dropped records
+  uint16_t checksum; // fletcher-16 over everything before it
+};
+
+static_assert(sizeof(telemetry_record) == 32, "host decoder expects 32 byte records");
+
+void telemetry_task(void* params);
+void telemetry_register_commands();
+// Never blocks, drops the record if the ring is full or nobody's listening
+void telemetry_push(telemetry_source source, telemetry_record* record);
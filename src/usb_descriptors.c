@@ -54,9 +54,9 @@
 #define TUD_RPI_RESET_DESC_LEN  9
 #define TUD_GS_USB_DESC_LEN     9 + 7 + 7
 #if !PICO_STDIO_USB_ENABLE_RESET_VIA_VENDOR_INTERFACE
-#define USBD_DESC_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_GS_USB_DESC_LEN)
+#define USBD_DESC_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_GS_USB_DESC_LEN + TUD_CDC_DESC_LEN)
 #else
-#define USBD_DESC_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_RPI_RESET_DESC_LEN + TUD_GS_USB_DESC_LEN)
+#define USBD_DESC_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_RPI_RESET_DESC_LEN + TUD_GS_USB_DESC_LEN + TUD_CDC_DESC_LEN)
 #endif
 #if !PICO_STDIO_USB_DEVICE_SELF_POWERED
 #define USBD_CONFIGURATION_DESCRIPTOR_ATTRIBUTE (0)
@@ -68,13 +68,14 @@
 
 #define USBD_ITF_CDC       (0) // needs 2 interfaces
 #if !PICO_STDIO_USB_ENABLE_RESET_VIA_VENDOR_INTERFACE
-#define USBD_ITF_MAX       (3)
 #define USBD_ITF_GS_USB    (2)
 #else
 #define USBD_ITF_RPI_RESET (2)
 #define USBD_ITF_GS_USB    (3)
-#define USBD_ITF_MAX       (4)
 #endif
+// after gs_usb so bind-pico.sh's interface number doesn't move
+#define USBD_ITF_TELEMETRY (USBD_ITF_GS_USB + 1) // needs 2 interfaces
+#define USBD_ITF_MAX       (USBD_ITF_TELEMETRY + 2)
 
 #define USBD_CDC_EP_CMD (0x82)
 #define USBD_CDC_EP_OUT (0x03)
@@ -82,6 +83,10 @@
 #define USBD_CDC_CMD_MAX_SIZE (8)
 #define USBD_CDC_IN_OUT_MAX_SIZE (64)
 
+#define USBD_TELEMETRY_EP_CMD (0x84)
+#define USBD_TELEMETRY_EP_OUT (0x05)
+#define USBD_TELEMETRY_EP_IN (0x85)
+
 #define USBD_STR_0 (0x00)
 #define USBD_STR_MANUF (0x01)
 #define USBD_STR_PRODUCT (0x02)
@@ -89,6 +94,7 @@
 #define USBD_STR_CDC (0x04)
 #define USBD_STR_RPI_RESET (0x05)
 #define USBD_STR_GS_USB (0x06)
+#define USBD_STR_TELEMETRY (0x07)
 
 // Note: descriptors returned from callbacks must exist long enough for transfer to complete
 
@@ -152,6 +158,9 @@ static const uint8_t usbd_desc_cfg[USBD_DESC_LEN] = {
 #endif
 
     TUD_GS_USB_DESCRIPTOR(USBD_ITF_GS_USB, USBD_STR_GS_USB)
+
+    TUD_CDC_DESCRIPTOR(USBD_ITF_TELEMETRY, USBD_STR_TELEMETRY, USBD_TELEMETRY_EP_CMD,
+        USBD_CDC_CMD_MAX_SIZE, USBD_TELEMETRY_EP_OUT, USBD_TELEMETRY_EP_IN, USBD_CDC_IN_OUT_MAX_SIZE),
 };
 
 static char usbd_serial_str[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
@@ -164,7 +173,8 @@ static const char *const usbd_desc_str[] = {
 #if PICO_STDIO_USB_ENABLE_RESET_VIA_VENDOR_INTERFACE
     [USBD_STR_RPI_RESET] = "Reset",
 #endif
-    [USBD_STR_GS_USB] = "GS USB"
+    [USBD_STR_GS_USB] = "GS USB",
+    [USBD_STR_TELEMETRY] = "Telemetry"
 };
 
 const uint8_t *tud_descriptor_device_cb(void) {
@@ -0,0 +1,82 @@
+import struct
+import sys
+
+# Must match telemetry_record in src/telemetry.h
+RECORD = struct.Struct("<HBBIfffffHH")
+MAGIC = 0x5AA5
+MAGIC_BYTES = struct.pack("<H", MAGIC)
+TYPES = {1: "control", 2: "status"}
+
+def fletcher16(data):
+    a = 0
+    b = 0
+    for byte in data:
+        a = (a + byte) % 255
+        b = (b + a) % 255
+    return (b << 8) | a
+
+def decode(stream, live=False):
+    # Yields records as dicts, resyncing on the magic whenever a checksum doesn't match.
+    # A live port only ends when it's closed: an empty read is just a quiet second (telem off, no motors), and
+    # we take whatever has arrived instead of waiting for a full chunk so slow records don't lag.
+    buf = b""
+    while True:
+        if live:
+            chunk = stream.read(max(1, stream.in_waiting))
+            if not chunk:
+                continue
+        else:
+            chunk = stream.read(RECORD.size * 32)
+            if not chunk:
+                return
+        buf += chunk
+        while len(buf) >= RECORD.size:
+            start = buf.find(MAGIC_BYTES)
+            if start < 0:
+                buf = buf[-1:]
+                break
+            buf = buf[start:]
+            if len(buf) < RECORD.size:
+                break
+            raw = buf[:RECORD.size]
+            fields = RECORD.unpack(raw)
+            if fletcher16(raw[:-2]) != fields[-1]:
+                buf = buf[1:]
+                continue
+            buf = buf[RECORD.size:]
+            _, kind, device, timestamp, position, velocity, current, output, error, seq, _ = fields
+            yield {
+                "type": TYPES.get(kind, str(kind)),
+                "device": device,
+                "timestamp_us": timestamp,
+                "position": position,
+                "velocity": velocity,
+                "current": current,
+                "output": output,
+                "error": error,
+                "seq": seq,
+            }
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print("Usage: telemetry_decode.py <telemetry tty (e.g. /dev/ttyACM1) or capture file>")
+        sys.exit(1)
+
+    path = sys.argv[1]
+    live = path.startswith("/dev/")
+    if live:
+        import serial  # pyserial, only needed when reading the port live
+        # opening the port sets DTR, which is what tells the pico someone is listening
+        stream = serial.Serial(path, timeout=1)
+    else:
+        stream = open(path, "rb")
+
+    columns = ["type", "device", "timestamp_us", "position", "velocity", "current", "output", "error", "seq"]
+    print(",".join(columns))
+    last_seq = {}
+    for record in decode(stream, live):
+        expected = last_seq.get(record["type"])
+        if expected is not None and record["seq"] != (expected + 1) & 0xFFFF:
+            print(f"# dropped {(record['seq'] - expected - 1) & 0xFFFF} {record['type']} records", file=sys.stderr)
+        last_seq[record["type"]] = record["seq"]
+        print(",".join(str(record[c]) for c in columns), flush=True)
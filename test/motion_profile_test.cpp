@@ -0,0 +1,162 @@
+#include "motion_profile.h"
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while(0)
+
+#define CHECK_NEAR(a, b, tol) do { \
+    float a_ = (a), b_ = (b); \
+    if(std::fabs(a_ - b_) > (tol)) { \
+      printf("%s:%d: check failed: %s = %f, expected %f\n", __FILE__, __LINE__, #a, a_, b_); \
+      failures++; \
+    } \
+  } while(0)
+
+static const float dt = 0.001f;
+
+struct run_result {
+  int steps;
+  float max_velocity;    // biggest |velocity| seen
+  float max_step;        // biggest position jump beyond what the velocity accounts for
+  float max_dv;          // biggest velocity change per step, per second
+  bool done;
+  float final_position;
+};
+
+// Steps the profile until it finishes, checking the trajectory is continuous on the way, including the last step
+// where it lands on the goal
+static run_result run(motion_profile* profile, int max_steps = 100000) {
+  run_result r = {};
+  motion_profile_point last = profile->current;
+  for(r.steps = 0; r.steps < max_steps && !profile->done; r.steps++) {
+    motion_profile_point p = motion_profile_step(profile, dt);
+    float allowed = std::max(std::fabs(last.velocity), std::fabs(p.velocity)) * dt;
+    r.max_step = std::max(r.max_step, std::fabs(p.position - last.position) - allowed);
+    r.max_dv = std::max(r.max_dv, std::fabs(p.velocity - last.velocity) / dt);
+    r.max_velocity = std::max(r.max_velocity, std::fabs(p.velocity));
+    last = p;
+  }
+  r.done = profile->done;
+  r.final_position = profile->current.position;
+  return r;
+}
+
+static void check_run(const run_result& r, const motion_profile_limits& limits, float goal) {
+  CHECK(r.done);
+  CHECK_NEAR(r.final_position, goal, 1e-4f);
+  CHECK(r.max_velocity <= limits.max_velocity * 1.001f);
+  CHECK(r.max_step < 1e-4f);
+  CHECK(r.max_dv <= limits.max_acceleration * 1.01f);
+}
+
+static void test_trapezoid() {
+  motion_profile_limits limits = {2.0f, 4.0f, 0.0f};
+  motion_profile profile;
+  motion_profile_init(&profile, &limits, 0.0f);
+  motion_profile_set_goal(&profile, 10.0f);
+  run_result r = run(&profile);
+  check_run(r, limits, 10.0f);
+  // 0.5 s up, 4.5 s cruise, 0.5 s down
+  CHECK_NEAR(r.max_velocity, 2.0f, 1e-4f);
+  CHECK(std::abs(r.steps - 5500) <= 2);
+}
+
+static void test_triangle() {
+  motion_profile_limits limits = {10.0f, 4.0f, 0.0f};
+  motion_profile profile;
+  motion_profile_init(&profile, &limits, 0.0f);
+  motion_profile_set_goal(&profile, 1.0f);
+  run_result r = run(&profile);
+  check_run(r, limits, 1.0f);
+  // never gets near max velocity, peaks at sqrt(a * d) = 2 halfway
+  CHECK_NEAR(r.max_velocity, 2.0f, 0.01f);
+  CHECK(std::abs(r.steps - 1000) <= 2);
+}
+
+static void test_s_curve() {
+  motion_profile_limits limits = {2.0f, 4.0f, 20.0f};
+  motion_profile profile;
+  motion_profile_init(&profile, &limits, 0.0f);
+  motion_profile_set_goal(&profile, 5.0f);
+  float max_da = 0;
+  float last_accel = 0;
+  motion_profile_point last = profile.current;
+  while(!profile.done) {
+    motion_profile_point p = motion_profile_step(&profile, dt);
+    max_da = std::max(max_da, std::fabs(p.acceleration - last_accel) / dt);
+    CHECK(std::fabs(p.acceleration) <= limits.max_acceleration * 1.001f);
+    last_accel = p.acceleration;
+    last = p;
+  }
+  CHECK_NEAR(last.position, 5.0f, 1e-4f);
+  // acceleration ramps at the jerk limit rather than stepping
+  CHECK(max_da <= limits.max_jerk * 1.01f);
+
+  motion_profile_init(&profile, &limits, 0.0f);
+  motion_profile_set_goal(&profile, 5.0f);
+  check_run(run(&profile), limits, 5.0f);
+}
+
+static void test_negative_distance() {
+  motion_profile_limits limits = {2.0f, 4.0f, 20.0f};
+  motion_profile profile;
+  motion_profile_init(&profile, &limits, 3.0f);
+  motion_profile_set_goal(&profile, -4.0f);
+  motion_profile_point first = motion_profile_step(&profile, dt);
+  CHECK(first.velocity < 0);
+  check_run(run(&profile), limits, -4.0f);
+}
+
+// Max velocity gets turned down mid-move, so the replan starts above the new limit. It has to slow down to it and
+// still land on the goal instead of overshooting and jumping back at the end.
+static void test_start_above_max_velocity() {
+  for(float jerk : {0.0f, 20.0f}) {
+    motion_profile_limits limits = {4.0f, 4.0f, jerk};
+    motion_profile profile;
+    motion_profile_init(&profile, &limits, 0.0f);
+    motion_profile_set_goal(&profile, 10.0f);
+    while(profile.current.velocity < 3.9f) motion_profile_step(&profile, dt);
+
+    motion_profile_limits slower = {1.0f, 4.0f, jerk};
+    profile.limits = slower;
+    // far enough to stop from here, but not if it has to pass through 1 on the way (with a jerk limit)
+    float goal = profile.current.position + 2.35f;
+    motion_profile_set_goal(&profile, goal);
+    run_result r = run(&profile);
+    CHECK(r.done);
+    CHECK_NEAR(r.final_position, goal, 1e-4f);
+    CHECK(r.max_step < 1e-4f);
+    CHECK(r.max_dv <= limits.max_acceleration * 1.01f);
+  }
+}
+
+// Too close to stop, so it overshoots, stops, and comes back
+static void test_overshoot_and_return() {
+  motion_profile_limits limits = {4.0f, 4.0f, 0.0f};
+  motion_profile profile;
+  motion_profile_init(&profile, &limits, 0.0f);
+  motion_profile_set_goal(&profile, 10.0f);
+  while(profile.current.velocity < 3.9f) motion_profile_step(&profile, dt);
+  float goal = profile.current.position + 0.5f;
+  motion_profile_set_goal(&profile, goal);
+  check_run(run(&profile), limits, goal);
+}
+
+int main() {
+  test_trapezoid();
+  test_triangle();
+  test_s_curve();
+  test_negative_distance();
+  test_start_above_max_velocity();
+  test_overshoot_and_return();
+  if(failures == 0) printf("motion_profile_test: all passed\n");
+  return failures == 0 ? 0 : 1;
+}
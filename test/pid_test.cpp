@@ -0,0 +1,130 @@
+#include "pid.h"
+#include <cmath>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while(0)
+
+#define CHECK_NEAR(a, b, tol) do { \
+    float a_ = (a), b_ = (b); \
+    if(std::fabs(a_ - b_) > (tol)) { \
+      printf("%s:%d: check failed: %s = %f, expected %f\n", __FILE__, __LINE__, #a, a_, b_); \
+      failures++; \
+    } \
+  } while(0)
+
+static const float dt = 0.01f;
+
+// Held well away from the setpoint with the output pinned, the integrator should stop at about the clamp instead of
+// soaking up the whole error, so the output comes off the clamp soon after the error flips
+static void test_anti_windup() {
+  pid_gains gains = pid_default_gains(1.0f);
+  gains.ki = 10.0f;
+  gains.i_max = 100.0f;
+  pid_state state = {};
+  for(int i = 0; i < 500; i++) {
+    CHECK(pid_update(&gains, &state, 5.0f, 0.0f, dt) <= 1.0f);
+  }
+  CHECK(state.integral <= 1.0f + gains.ki * 5.0f * dt);
+  // a wound up integrator (25 here) would keep it pinned for a few seconds
+  float out = 1.0f;
+  for(int i = 0; i < 10; i++) {
+    out = pid_update(&gains, &state, 0.0f, 1.0f, dt);
+  }
+  CHECK(out < 1.0f);
+}
+
+static void test_back_calculation() {
+  pid_gains gains = pid_default_gains(1.0f);
+  gains.kp = 10.0f;
+  gains.ki = 1.0f;
+  gains.kaw = 5.0f;
+  pid_state state = {};
+  state.integral = 0.5f;
+  state.initialized = true;
+  // kp alone saturates it, back-calculation should bleed the integrator off
+  pid_update(&gains, &state, 1.0f, 0.0f, dt);
+  CHECK(state.integral < 0.5f);
+}
+
+static void test_integral_limit() {
+  pid_gains gains = pid_default_gains(100.0f);
+  gains.ki = 10.0f;
+  gains.i_max = 0.5f;
+  pid_state state = {};
+  for(int i = 0; i < 100; i++) {
+    pid_update(&gains, &state, 1.0f, 0.0f, dt);
+  }
+  CHECK_NEAR(state.integral, 0.5f, 1e-6f);
+}
+
+// Derivative is on the measurement, so a setpoint step alone doesn't touch it, and the low-pass takes the edge off a
+// step in the measurement
+static void test_derivative() {
+  pid_gains gains = pid_default_gains(1000.0f);
+  gains.kd = 1.0f;
+  pid_state state = {};
+  pid_update(&gains, &state, 0.0f, 0.0f, dt);
+  CHECK_NEAR(pid_update(&gains, &state, 10.0f, 0.0f, dt), 0.0f, 1e-6f);
+
+  pid_state unfiltered = {};
+  pid_update(&gains, &unfiltered, 0.0f, 0.0f, dt);
+  CHECK_NEAR(pid_update(&gains, &unfiltered, 0.0f, 1.0f, dt), -100.0f, 1e-3f);
+
+  gains.d_filter_tau = 0.1f;
+  pid_state filtered = {};
+  pid_update(&gains, &filtered, 0.0f, 0.0f, dt);
+  float out = pid_update(&gains, &filtered, 0.0f, 1.0f, dt);
+  CHECK_NEAR(out, -100.0f * dt / (0.1f + dt), 1e-3f);
+  // and it decays once the measurement stops moving
+  float next = pid_update(&gains, &filtered, 0.0f, 1.0f, dt);
+  CHECK(next > out && next < 0.0f);
+}
+
+static void test_slew_limit() {
+  pid_gains gains = pid_default_gains(1.0f);
+  gains.kp = 100.0f;
+  gains.slew_rate = 2.0f;
+  pid_state state = {};
+  CHECK_NEAR(pid_update(&gains, &state, 0.0f, 0.0f, dt), 0.0f, 1e-6f);
+  float last = 0.0f;
+  for(int i = 0; i < 20; i++) {
+    float out = pid_update(&gains, &state, 1.0f, 0.0f, dt);
+    CHECK_NEAR(out - last, gains.slew_rate * dt, 1e-5f);
+    last = out;
+  }
+  // still clamped once it gets there
+  for(int i = 0; i < 100; i++) {
+    last = pid_update(&gains, &state, 1.0f, 0.0f, dt);
+  }
+  CHECK_NEAR(last, 1.0f, 1e-6f);
+}
+
+static void test_feed_forward() {
+  pid_gains gains = pid_default_gains(100.0f);
+  gains.ks = 0.1f;
+  gains.kv = 2.0f;
+  gains.ka = 0.5f;
+  pid_state state = {};
+  CHECK_NEAR(pid_update(&gains, &state, 0.0f, 0.0f, dt, 1.5f, 2.0f), 0.1f + 3.0f + 1.0f, 1e-5f);
+  CHECK_NEAR(pid_update(&gains, &state, 0.0f, 0.0f, dt, -1.5f, 0.0f), -0.1f - 3.0f, 1e-5f);
+  // no kS without a reference velocity
+  CHECK_NEAR(pid_update(&gains, &state, 0.0f, 0.0f, dt, 0.0f, 2.0f), 1.0f, 1e-5f);
+}
+
+int main() {
+  test_anti_windup();
+  test_back_calculation();
+  test_integral_limit();
+  test_derivative();
+  test_slew_limit();
+  test_feed_forward();
+  if(failures == 0) printf("pid_test: all passed\n");
+  return failures == 0 ? 0 : 1;
+}